@@ -7,7 +7,6 @@
 #define EE_HANDS
 
 #define SPLIT_LAYER_STATE_ENABLE
-#define SPLIT_TRANSPORT_MIRROR
 //#define SPLIT_LED_STATE_ENABLE
 //#define SPLIT_MODS_ENABLE
 
@@ -16,9 +15,29 @@
 #define RGBLIGHT_DEFAULT_HUE 85
 #define RGBLIGHT_DEFAULT_SAT 255
 
-#define RGBLIGHT_SPLIT
+// SPLIT_LOCAL_LIGHTS (rules.mk): each half renders its own LEDs from the
+// synced layer state, and the indicator flags travel in one user transaction.
+// Otherwise the master's rgblight state is mirrored to the other half.
+// TUNING_ENABLE (rules.mk) sends runtime timing parameters in another.
+#ifdef SPLIT_LOCAL_LIGHTS
+#    undef RGBLIGHT_SPLIT
+#else
+#    define SPLIT_TRANSPORT_MIRROR
+#    define RGBLIGHT_SPLIT
+#endif
+#if defined(TUNING_ENABLE) && defined(SPLIT_LOCAL_LIGHTS)
+#    define SPLIT_TRANSACTION_IDS_USER RPC_ID_USER_TUNING, RPC_ID_USER_INDICATORS
+#elif defined(TUNING_ENABLE)
+#    define SPLIT_TRANSACTION_IDS_USER RPC_ID_USER_TUNING
+#elif defined(SPLIT_LOCAL_LIGHTS)
+#    define SPLIT_TRANSACTION_IDS_USER RPC_ID_USER_INDICATORS
+#endif
+
+// Minimum time between retries of a failed user split transaction
+#define SPLIT_SYNC_RETRY 100
 
 #define RGBLIGHT_LAYERS
+#define RGBLIGHT_MAX_LAYERS 10 // 7 keymap layers + jiggler, turbo and caps indicators
 #define RGBLIGHT_DISABLE_KEYCODES
 
 #define RGBLIGHT_DEFAULT_MODE RGBLIGHT_MODE_STATIC_LIGHT
@@ -31,6 +50,60 @@
 
 // #define TAPPING_TOGGLE 1 // tap just once for TT() to toggle the layer
 #define TAPPING_TERM 200
+#define TAPPING_TERM_PER_KEY // get_tapping_term() in keymap.c, tunable at runtime
+
+// Per-dance tapping terms learned from typing (keymap.c). Terms stay within
+// TAPPING_TERM_MIN..TAPPING_TERM_MAX and sit ADAPTIVE_TERM_SPREAD mean
+// deviations above the observed tap lengths and tap-to-tap intervals once
+// ADAPTIVE_TERM_WARMUP taps are in. Learned timings are saved to the user EEPROM datablock at
+// most every ADAPTIVE_TERM_SAVE_INTERVAL ms, after ADAPTIVE_TERM_SAVE_IDLE ms
+// without input.
+#define ADAPTIVE_TAPPING_TERM
+#ifdef ADAPTIVE_TAPPING_TERM
+#    define TAPPING_TERM_MIN 120
+#    define TAPPING_TERM_MAX 300
+#    define ADAPTIVE_TERM_SPREAD 4
+#    define ADAPTIVE_TERM_WARMUP 32
+#    define ADAPTIVE_TERM_SAVE_INTERVAL 600000
+#    define ADAPTIVE_TERM_SAVE_IDLE 5000
+#endif
+
+// Usage heatmap (keymap.c, HEATMAP_ENABLE in rules.mk): counts are saved at
+// most every HEATMAP_SAVE_INTERVAL ms, after HEATMAP_SAVE_IDLE ms without input
+#define HEATMAP_SAVE_INTERVAL 1800000
+#define HEATMAP_SAVE_IDLE 5000
+
+// Dynamic macros (keymap.c): MACRO_BANKS banks of two MACRO_SLOT_SIZE byte
+// slots, with delays recorded in MACRO_TIME_QUANTUM ms steps
+#define MACRO_BANKS 8
+#define MACRO_SLOT_SIZE 512
+#define MACRO_TIME_QUANTUM 4
+
+// User EEPROM datablock layout. The emulated EEPROM is enlarged to hold the
+// macro store; wear leveling keeps it in the RP2040's flash.
+#define ADAPTIVE_TERM_STORE_OFFSET 0
+#define ADAPTIVE_TERM_STORE_SIZE 192
+#define MACRO_STORE_OFFSET (ADAPTIVE_TERM_STORE_OFFSET + ADAPTIVE_TERM_STORE_SIZE)
+#define MACRO_STORE_SIZE (MACRO_BANKS * 2 * MACRO_SLOT_SIZE)
+#define HEATMAP_STORE_OFFSET (MACRO_STORE_OFFSET + MACRO_STORE_SIZE)
+#define HEATMAP_STORE_SIZE 1152
+#define TUNING_STORE_OFFSET (HEATMAP_STORE_OFFSET + HEATMAP_STORE_SIZE)
+#define TUNING_STORE_SIZE 64
+#define EECONFIG_USER_DATA_SIZE (TUNING_STORE_OFFSET + TUNING_STORE_SIZE)
+#define WEAR_LEVELING_LOGICAL_SIZE 16384
+#define WEAR_LEVELING_BACKING_SIZE 32768
+
+// How long a tap-dance keycode stays registered after its dance resets, and
+// how many such releases can be pending at once
+#define TAP_RELEASE_DELAY 10
+#define RELEASE_QUEUE_SIZE 8
+
+// Digits 1-6 on the base layers are sent on the press of each tap instead of
+// after TAPPING_TERM; the double-hold layer move backspaces them again
+#define TD_SPECULATIVE_DIGITS
+
+// Per-key debounce time (keymap.c, DEBOUNCE_TYPE = custom)
+#define DEBOUNCE 5
 
 #define MOUSEKEY_DELAY 20
 #define MOUSEKEY_INTERVAL 20
@@ -38,6 +111,50 @@
 #define MOUSEKEY_TIME_TO_MAX 40
 #define MOUSEKEY_WHEEL_MAX_SPEED 10
 
+// Kinetic mouse keys (keymap.c): pointer movement with sub-pixel accumulation
+// and a smooth ramp between the speeds set above, updated every
+// KINETIC_MOUSE_INTERVAL ms. Comment out for the stock mousekey movement.
+#define KINETIC_MOUSE
+#define KINETIC_MOUSE_INTERVAL 1
+
+// Mouse jiggler: nudge every JIGGLER_INTERVAL ms, but only once no key has
+// been pressed for JIGGLER_IDLE_TIMEOUT ms. JIGGLER_STEP is the nudge size in
+// pixels; each nudge is immediately reversed.
+#define JIGGLER_INTERVAL 30000
+#define JIGGLER_IDLE_TIMEOUT 10000
+#define JIGGLER_STEP 1
+
+// Turbo rapid-fire on the GAMING layer: held keys toggle between released and
+// pressed every TURBO_INTERVAL ms (1 = one transition per USB frame), for up
+// to TURBO_MAX_KEYS keys at once. Only Q, E, R, F, G, Z, X, C and V
+// (turbo_keycodes in keymap.c) auto-fire.
+#define TURBO_INTERVAL 20
+#define TURBO_MAX_KEYS 6
+
+// GAMING layer fast path: no tap dances on the layer, so every key is sent on
+// the press edge. The inner right key (] on the other layers) returns to the
+// base layer. Comment out to restore the tap dances.
+#define GAMING_FAST_PATH
+
+// The thumb modifier tap dances (TD_LGUI_ALT, TD_RALT_CTRL) decide tap or
+// hold from the keys pressed inside the hold, with a policy per key
+// (keymap.c). Up to TAP_HOLD_BUFFER key events wait for a decision. Comment
+// out to resolve them as plain tap dances.
+#define TAP_HOLD_DECISIONS
+#define TAP_HOLD_BUFFER 8
+
+// Layer combos (keymap.c): a digit pressed together with the key below it
+// within COMBO_TERM ms moves to that digit's layer. Only a combo's first key
+// can open the window, and a speculative digit is not even held for it.
+// Combos have up to COMBO_MAX_KEYS keys and are found in a hash table of
+// 2^COMBO_TABLE_BITS slots. For the combo benchmark (README),
+// COMBO_BENCH_COUNT pads the table with inactive combos up to that many; 200
+// needs COMBO_TABLE_BITS 10.
+#define COMBO_TERM 30
+#define COMBO_MAX_KEYS 2
+#define COMBO_TABLE_BITS 6
+// #define COMBO_BENCH_COUNT 200
+
 #define NO_ACTION_MACRO
 #define NO_ACTION_FUNCTION
 #define NO_ACTION_ONESHOT
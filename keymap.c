@@ -4,9 +4,25 @@
 
 #include QMK_KEYBOARD_H
 
+// HOT_PATH_IN_RAM (rules.mk) links the key-event path below into SRAM: the
+// RP2040 linker script copies .time_critical sections to RAM at boot, so this
+// file's part of it never waits on an XIP cache miss after RGB or split code
+// has evicted it. LTO may still inline the small helpers, and an inlined copy
+// lives in its caller's section. What they call outside this file still runs
+// from flash: QMK core, and the libgcc helpers for what the Cortex-M0+ has no
+// instruction for (__clzsi2, __popcountsi2, division). The keymap itself is
+// already read from RAM (Keymap RAM copy).
+#ifdef HOT_PATH_IN_RAM
+#    define HOT_PATH __attribute__((section(".time_critical.reverie")))
+#else
+#    define HOT_PATH
+#endif
+
 enum custom_keycodes {
     TURBO = SAFE_RANGE,
     JIGGLER,
+    MC_BANK, // next dynamic macro bank
+    MC_SPEED, // dynamic macro playback speed: 1x, 2x, as fast as the host polls
 };
 
 bool jiggle_macro = false;
@@ -18,7 +34,7 @@ bool turbo_macro = false;
 // 3. Add RGB layer definition with HSV color below
 // 4. Add layer to keymaps[] array in the correct order
 // 5. Add RGB light layer to MY_LIGHT_LAYERS array
-// 6. Add layer case to layer_state_set_user() function
+// 6. Update LAST_LAYER below if the new layer is the last one
 // 7. Add CSS styling rule to keymap-drawer-config.yaml (svg.keymap g.layer-NEWLAYER)
 // 8. Add text styling rule to keymap-drawer-config.yaml for proper contrast
 enum iris_layers {
@@ -39,6 +55,7 @@ enum iris_layers {
 #define SYS_LAYER _SYSTEM
 #define GAMING_LAYER _GAMING
 #define MACRO_LAYER _MACRO
+#define LAST_LAYER _MACRO
 
 // Transparent key for readability
 #define _______ KC_TRNS
@@ -66,6 +83,28 @@ enum iris_layers {
 #define MO_SY MO(SYM_LAYER)
 #define MO_MM MO(SYS_LAYER)
 #define MO_GM MO(GAMING_LAYER)
+
+// _GAMING keys that are tap dances elsewhere. With GAMING_FAST_PATH every key
+// on the layer is a plain keycode reported on the press edge, and the base
+// layer exit moves from the Left Control double-hold to GM_EXIT, the inner
+// right key, which no game holds as an input.
+#ifdef GAMING_FAST_PATH
+#    define GM_9    KC_9
+#    define GM_0    KC_0
+#    define GM_ENT  KC_ENT
+#    define GM_LGUI KC_LGUI
+#    define GM_LCTL KC_LCTL
+#    define GM_RALT KC_RALT
+#    define GM_EXIT TO_QW
+#else
+#    define GM_9    TD(TD_9_MIN)
+#    define GM_0    TD(TD_0_EQ)
+#    define GM_ENT  TD(TD_ENT_BSLS)
+#    define GM_LGUI TD(TD_LGUI_ALT)
+#    define GM_LCTL TD(TD_LCTL_BASE)
+#    define GM_RALT TD(TD_RALT_CTRL)
+#    define GM_EXIT KC_RBRC
+#endif
 #define MO_MA MO(MACRO_LAYER)
 
 // MACROS
@@ -98,650 +137,683 @@ enum tap_dance_codes {
     TD_LCTL_BASE, // Left Control tap, double-hold to return to base layer
     TD_LGUI_ALT,   // Left GUI or double-hold for left alt
     TD_RALT_CTRL,  // Right Alt or double-hold for right control
+    TD_COUNT
 };
 
-// Helper functions for advanced tap dance
+// Split user transactions. A send that fails is retried no sooner than
+// SPLIT_SYNC_RETRY ms later, and nothing is sent while the other half is
+// disconnected, so a missing half never costs a transport timeout per loop.
 typedef struct {
-    bool is_press_action;
-    uint8_t step;
-} tap_state_t;
-
-enum {
-    SINGLE_TAP = 1,
-    SINGLE_HOLD,
-    DOUBLE_TAP,
-    DOUBLE_HOLD,
-    DOUBLE_SINGLE_TAP,
-    MORE_TAPS
-};
-
-// Forward declaration
-tap_dance_action_t tap_dance_actions[];
-
-#define TD_COUNT 17
-static tap_state_t tap_state[TD_COUNT];
-
-uint8_t get_tap_dance_step(tap_dance_state_t *state);
-
-uint8_t get_tap_dance_step(tap_dance_state_t *state) {
-    if (state->count == 1) {
-        if (state->interrupted || !state->pressed) return SINGLE_TAP;
-        else return SINGLE_HOLD;
-    } else if (state->count == 2) {
-        if (state->interrupted) return DOUBLE_SINGLE_TAP;
-        else if (state->pressed) return DOUBLE_HOLD;
-        else return DOUBLE_TAP;
-    }
-    return MORE_TAPS;
-}
+    uint16_t failed_at;
+    bool failed;
+} split_sync_t;
 
-// Tap dance for number 1 - tap for 1, double-hold for FUNCTION layer
-void on_dance_1(tap_dance_state_t *state, void *user_data);
-void dance_1_fn_finished(tap_dance_state_t *state, void *user_data);
-void dance_1_fn_reset(tap_dance_state_t *state, void *user_data);
+bool split_sync_send(split_sync_t *sync, int8_t id, uint8_t length, const void *data);
 
-void on_dance_1(tap_dance_state_t *state, void *user_data) {
-    if(state->count == 3) {
-        tap_code16(KC_1);
-        tap_code16(KC_1);
-        tap_code16(KC_1);
-    }
-    if(state->count > 3) {
-        tap_code16(KC_1);
+bool split_sync_send(split_sync_t *sync, int8_t id, uint8_t length, const void *data) {
+    if (!is_transport_connected() || (sync->failed && timer_elapsed(sync->failed_at) < SPLIT_SYNC_RETRY)) {
+        return false;
     }
+    sync->failed = !transaction_rpc_send(id, length, data);
+    sync->failed_at = timer_read();
+    return !sync->failed;
 }
 
-void dance_1_fn_finished(tap_dance_state_t *state, void *user_data) {
-    tap_state[0].step = get_tap_dance_step(state);
-    switch (tap_state[0].step) {
-        case SINGLE_TAP: register_code16(KC_1); break;
-        case DOUBLE_TAP: register_code16(KC_1); register_code16(KC_1); break;
-        case DOUBLE_HOLD: layer_move(_FUNCTION); break;
-        case DOUBLE_SINGLE_TAP: tap_code16(KC_1); register_code16(KC_1);
-    }
-}
-
-void dance_1_fn_reset(tap_dance_state_t *state, void *user_data) {
-    wait_ms(10);
-    switch (tap_state[0].step) {
-        case SINGLE_TAP: unregister_code16(KC_1); break;
-        case DOUBLE_TAP: unregister_code16(KC_1); break;
-        case DOUBLE_SINGLE_TAP: unregister_code16(KC_1); break;
-    }
-    tap_state[0].step = 0;
-}
+// --------------
+// Runtime tuning
+// --------------
+
+// The timing parameters below start from their config.h values. With
+// TUNING_ENABLE (rules.mk) they can be read and changed over raw HID without
+// reflashing: the master pushes every change to the other half in a split
+// transaction (the slave debounces its own matrix) and HID_CMD_TUNING_SAVE
+// keeps the current set in the user EEPROM datablock. Without it they are
+// constants. All fields are uint16_t in wire order; tools/reverie-hid lists
+// them in the same order.
+#ifndef MOUSEKEY_MOVE_DELTA
+#    define MOUSEKEY_MOVE_DELTA 8
+#endif
+#define KINETIC_MOUSE_START_SPEED (MOUSEKEY_MOVE_DELTA * 1000L / MOUSEKEY_INTERVAL)  // px/s
+#define KINETIC_MOUSE_MAX_SPEED (KINETIC_MOUSE_START_SPEED * MOUSEKEY_MAX_SPEED)      // px/s
+#define KINETIC_MOUSE_RAMP (MOUSEKEY_DELAY + MOUSEKEY_TIME_TO_MAX * MOUSEKEY_INTERVAL) // ms
 
-// Tap dance for number 2 - tap for 2, double-hold for NUMBERS layer
-void on_dance_2(tap_dance_state_t *state, void *user_data);
-void dance_2_num_finished(tap_dance_state_t *state, void *user_data);
-void dance_2_num_reset(tap_dance_state_t *state, void *user_data);
+typedef struct {
+    uint16_t tapping_term;      // ms, tap dances without a learned term
+    uint16_t tap_release_delay; // ms
+    uint16_t debounce;          // ms
+    uint16_t mouse_start_speed; // px/s, kinetic mouse keys
+    uint16_t mouse_max_speed;   // px/s
+    uint16_t mouse_ramp;        // ms from start to max speed
+    uint16_t jiggler_interval;  // ms
+    uint16_t jiggler_idle;      // ms
+    uint16_t jiggler_step;      // px
+    uint16_t turbo_interval;    // ms
+} tuning_t;
+
+#define TUNING_DEFAULTS                                                                   \
+    {TAPPING_TERM, TAP_RELEASE_DELAY, DEBOUNCE, KINETIC_MOUSE_START_SPEED, KINETIC_MOUSE_MAX_SPEED, \
+     KINETIC_MOUSE_RAMP, JIGGLER_INTERVAL, JIGGLER_IDLE_TIMEOUT, JIGGLER_STEP, TURBO_INTERVAL}
+
+#ifdef TUNING_ENABLE
+#    define TUNING_MAGIC 0x5555 // "UU", bump when tuning_t changes
+#    define TUNING_FIELDS (sizeof(tuning_t) / sizeof(uint16_t))
 
-void on_dance_2(tap_dance_state_t *state, void *user_data) {
-    if(state->count == 3) {
-        tap_code16(KC_2);
-        tap_code16(KC_2);
-        tap_code16(KC_2);
-    }
-    if(state->count > 3) {
-        tap_code16(KC_2);
-    }
+typedef struct {
+    uint16_t magic;
+    tuning_t values;
+} tuning_store_t;
+
+_Static_assert(sizeof(tuning_store_t) <= TUNING_STORE_SIZE, "TUNING_STORE_SIZE too small");
+_Static_assert(sizeof(tuning_t) <= RPC_M2S_BUFFER_SIZE, "tuning_t does not fit one split transaction");
+
+static const tuning_t tuning_defaults = TUNING_DEFAULTS;
+// Accepted range of each field. Debounce timers are 8 bit, and deferred tasks
+// need an interval of at least 1 ms.
+static const tuning_t tuning_min = {50, 0, 1, 1, 1, 1, 100, 0, 1, 1};
+static const tuning_t tuning_max = {1000, 100, UINT8_MAX, 10000, 10000, 10000, UINT16_MAX, UINT16_MAX, 127, 1000};
+
+static tuning_t tuning = TUNING_DEFAULTS;
+static bool tuning_synced = false;
+static split_sync_t tuning_sync;
+
+// Clamps every field into its range after tuning was overwritten, and marks
+// it for the next split sync
+void tuning_apply(void) {
+    uint16_t *value = (uint16_t *)&tuning;
+    for (uint8_t i = 0; i < TUNING_FIELDS; i++) {
+        value[i] = MIN(MAX(value[i], ((const uint16_t *)&tuning_min)[i]), ((const uint16_t *)&tuning_max)[i]);
+    }
+    tuning.mouse_max_speed = MAX(tuning.mouse_max_speed, tuning.mouse_start_speed);
+    tuning_synced = false;
 }
 
-void dance_2_num_finished(tap_dance_state_t *state, void *user_data) {
-    tap_state[1].step = get_tap_dance_step(state);
-    switch (tap_state[1].step) {
-        case SINGLE_TAP: register_code16(KC_2); break;
-        case DOUBLE_TAP: register_code16(KC_2); register_code16(KC_2); break;
-        case DOUBLE_HOLD: layer_move(_NUMBERS); break;
-        case DOUBLE_SINGLE_TAP: tap_code16(KC_2); register_code16(KC_2);
-    }
+void tuning_load(void) {
+    tuning_store_t store;
+    eeconfig_read_user_datablock(&store, TUNING_STORE_OFFSET, sizeof(store));
+    tuning = store.magic == TUNING_MAGIC ? store.values : tuning_defaults;
+    tuning_apply();
 }
 
-void dance_2_num_reset(tap_dance_state_t *state, void *user_data) {
-    wait_ms(10);
-    switch (tap_state[1].step) {
-        case SINGLE_TAP: unregister_code16(KC_2); break;
-        case DOUBLE_TAP: unregister_code16(KC_2); break;
-        case DOUBLE_SINGLE_TAP: unregister_code16(KC_2); break;
-    }
-    tap_state[1].step = 0;
+void tuning_save(void) {
+    tuning_store_t store = {.magic = TUNING_MAGIC, .values = tuning};
+    eeconfig_update_user_datablock(&store, TUNING_STORE_OFFSET, sizeof(store));
 }
 
-// Tap dance for number 3 - tap for 3, double-hold for SYSTEM layer
-void on_dance_3(tap_dance_state_t *state, void *user_data);
-void dance_3_sys_finished(tap_dance_state_t *state, void *user_data);
-void dance_3_sys_reset(tap_dance_state_t *state, void *user_data);
-
-void on_dance_3(tap_dance_state_t *state, void *user_data) {
-    if(state->count == 3) {
-        tap_code16(KC_3);
-        tap_code16(KC_3);
-        tap_code16(KC_3);
-    }
-    if(state->count > 3) {
-        tap_code16(KC_3);
-    }
+void tuning_reset(void) {
+    tuning = tuning_defaults;
+    tuning_apply();
 }
 
-void dance_3_sys_finished(tap_dance_state_t *state, void *user_data) {
-    tap_state[2].step = get_tap_dance_step(state);
-    switch (tap_state[2].step) {
-        case SINGLE_TAP: register_code16(KC_3); break;
-        case DOUBLE_TAP: register_code16(KC_3); register_code16(KC_3); break;
-        case DOUBLE_HOLD: layer_move(_SYSTEM); break;
-        case DOUBLE_SINGLE_TAP: tap_code16(KC_3); register_code16(KC_3);
-    }
+void tuning_sync_slave(uint8_t in_buflen, const void *in_data, uint8_t out_buflen, void *out_data) {
+    memcpy(&tuning, in_data, MIN(in_buflen, sizeof(tuning)));
+    tuning_apply();
 }
 
-void dance_3_sys_reset(tap_dance_state_t *state, void *user_data) {
-    wait_ms(10);
-    switch (tap_state[2].step) {
-        case SINGLE_TAP: unregister_code16(KC_3); break;
-        case DOUBLE_TAP: unregister_code16(KC_3); break;
-        case DOUBLE_SINGLE_TAP: unregister_code16(KC_3); break;
+void tuning_task(void) {
+    if (is_keyboard_master() && !tuning_synced && split_sync_send(&tuning_sync, RPC_ID_USER_TUNING, sizeof(tuning), &tuning)) {
+        tuning_synced = true;
     }
-    tap_state[2].step = 0;
 }
+#else
+static const tuning_t tuning = TUNING_DEFAULTS;
+#endif
+
+// --------------------
+// Performance counters
+// --------------------
+
+// Built with REVERIE_PERF_ENABLE = yes in rules.mk. Every main-loop iteration
+// is timed on the RP2040's 1 MHz system timer from housekeeping_task_user();
+// the user hooks below are timed with PERF_BEGIN/PERF_END and the slowest
+// hook of each iteration is remembered so the worst stall can be traced back
+// to a keycode or callback. Counters are read over raw HID by
+// tools/reverie-hid. With the option off, all of this compiles away.
+#ifdef REVERIE_PERF_ENABLE
+
+#define PERF_HISTOGRAM_BUCKETS 16
+
+enum perf_hooks {
+    PERF_HOOK_RECORD,     // process_record_user
+    PERF_HOOK_SCAN,       // matrix_scan_user
+    PERF_HOOK_TAP_DANCE,  // tap-dance callbacks
+    PERF_HOOK_DEFERRED,   // deferred tasks (jiggler, turbo)
+    PERF_HOOK_LIGHTS,     // LED frames sent by the light render stage
+    PERF_HOOK_COMBO,      // combo table lookups
+    PERF_HOOK_COUNT
+};
 
-// Tap dance for number 4 - tap for 4, double-hold for GAMING layer
-void on_dance_4(tap_dance_state_t *state, void *user_data);
-void dance_4_game_finished(tap_dance_state_t *state, void *user_data);
-void dance_4_game_reset(tap_dance_state_t *state, void *user_data);
+// Tags name what was running; keycodes are used as-is, callbacks sit above
+// the 15-bit keycode range
+enum perf_tags {
+    PERF_TAG_IDLE = 0,
+    PERF_TAG_SCAN = 0x8001,
+    PERF_TAG_JIGGLER,
+    PERF_TAG_TURBO,
+    PERF_TAG_MOUSE,
+    PERF_TAG_LIGHTS,
+    PERF_TAG_COMBO,
+    PERF_TAG_TAP_DANCE = 0x8100, // | tap dance index
+};
 
-void on_dance_4(tap_dance_state_t *state, void *user_data) {
-    if(state->count == 3) {
-        tap_code16(KC_4);
-        tap_code16(KC_4);
-        tap_code16(KC_4);
-    }
-    if(state->count > 3) {
-        tap_code16(KC_4);
+// Wire format read by tools/reverie-hid, keep the two in sync
+typedef struct __attribute__((packed)) {
+    uint32_t scan_rate;     // loop iterations completed in the last full second
+    uint32_t max_loop_time; // longest iteration seen, us
+    uint16_t max_loop_tag;  // slowest hook during that iteration
+    uint16_t frames_skipped; // light frames not sent because no pixel changed
+    uint32_t loop_histogram[PERF_HISTOGRAM_BUCKETS]; // bucket n: iterations of [2^n, 2^(n+1)) us
+    uint32_t hook_calls[PERF_HOOK_COUNT];
+    uint32_t hook_time[PERF_HOOK_COUNT]; // us
+} perf_counters_t;
+
+static perf_counters_t perf;
+static uint32_t perf_last_loop = 0;
+static uint32_t perf_window_start = 0;
+static uint32_t perf_window_scans = 0;
+static uint32_t perf_iteration_worst = 0;
+static uint16_t perf_iteration_tag = PERF_TAG_IDLE;
+
+// The RP2040 realtime counter is the free-running 1 MHz system timer
+#define perf_now() ((uint32_t)chSysGetRealtimeCounterX())
+
+#define PERF_BEGIN(tag) \
+    uint16_t perf_tag = (tag); \
+    uint32_t perf_start = perf_now()
+#define PERF_END(hook) perf_end(hook, perf_tag, perf_start)
+
+void perf_end(uint8_t hook, uint16_t tag, uint32_t start);
+void perf_loop_task(void);
+void perf_reset(void);
+
+void perf_end(uint8_t hook, uint16_t tag, uint32_t start) {
+    uint32_t elapsed = perf_now() - start;
+    perf.hook_calls[hook]++;
+    perf.hook_time[hook] += elapsed;
+    if (elapsed >= perf_iteration_worst) {
+        perf_iteration_worst = elapsed;
+        perf_iteration_tag = tag;
     }
 }
 
-void dance_4_game_finished(tap_dance_state_t *state, void *user_data) {
-    tap_state[3].step = get_tap_dance_step(state);
-    switch (tap_state[3].step) {
-        case SINGLE_TAP: register_code16(KC_4); break;
-        case DOUBLE_TAP: register_code16(KC_4); register_code16(KC_4); break;
-        case DOUBLE_HOLD: layer_move(_GAMING); break;
-        case DOUBLE_SINGLE_TAP: tap_code16(KC_4); register_code16(KC_4);
-    }
-}
+void perf_loop_task(void) {
+    uint32_t now = perf_now();
+    uint32_t loop_time = now - perf_last_loop;
+    perf_last_loop = now;
 
-void dance_4_game_reset(tap_dance_state_t *state, void *user_data) {
-    wait_ms(10);
-    switch (tap_state[3].step) {
-        case SINGLE_TAP: unregister_code16(KC_4); break;
-        case DOUBLE_TAP: unregister_code16(KC_4); break;
-        case DOUBLE_SINGLE_TAP: unregister_code16(KC_4); break;
+    uint8_t bucket = loop_time ? 31 - __builtin_clz(loop_time) : 0;
+    perf.loop_histogram[MIN(bucket, PERF_HISTOGRAM_BUCKETS - 1)]++;
+    if (loop_time > perf.max_loop_time) {
+        perf.max_loop_time = loop_time;
+        perf.max_loop_tag = perf_iteration_tag;
     }
-    tap_state[3].step = 0;
-}
+    perf_iteration_worst = 0;
+    perf_iteration_tag = PERF_TAG_IDLE;
 
-// Tap dance for number 5 - tap for 5, double-hold for MACRO layer
-void on_dance_5(tap_dance_state_t *state, void *user_data);
-void dance_5_macro_finished(tap_dance_state_t *state, void *user_data);
-void dance_5_macro_reset(tap_dance_state_t *state, void *user_data);
-
-void on_dance_5(tap_dance_state_t *state, void *user_data) {
-    if(state->count == 3) {
-        tap_code16(KC_5);
-        tap_code16(KC_5);
-        tap_code16(KC_5);
-    }
-    if(state->count > 3) {
-        tap_code16(KC_5);
+    perf_window_scans++;
+    if (now - perf_window_start >= 1000000) {
+        perf.scan_rate = perf_window_scans;
+        perf_window_scans = 0;
+        perf_window_start = now;
     }
 }
 
-void dance_5_macro_finished(tap_dance_state_t *state, void *user_data) {
-    tap_state[4].step = get_tap_dance_step(state);
-    switch (tap_state[4].step) {
-        case SINGLE_TAP: register_code16(KC_5); break;
-        case DOUBLE_TAP: register_code16(KC_5); register_code16(KC_5); break;
-        case DOUBLE_HOLD: layer_move(_MACRO); break;
-        case DOUBLE_SINGLE_TAP: tap_code16(KC_5); register_code16(KC_5);
-    }
-}
+// Press-to-output latency in ms: one histogram per tap dance, measured from
+// the dance's first press to the moment it registers a keycode, and a last
+// row shared by every other key, measured from the key event to
+// process_record_user
+#define LATENCY_BUCKETS 32
+#define LATENCY_BUCKET_MS 8
 
-void dance_5_macro_reset(tap_dance_state_t *state, void *user_data) {
-    wait_ms(10);
-    switch (tap_state[4].step) {
-        case SINGLE_TAP: unregister_code16(KC_5); break;
-        case DOUBLE_TAP: unregister_code16(KC_5); break;
-        case DOUBLE_SINGLE_TAP: unregister_code16(KC_5); break;
-    }
-    tap_state[4].step = 0;
-}
+static uint16_t latency_histogram[TD_COUNT + 1][LATENCY_BUCKETS];
+static uint16_t td_press_time[TD_COUNT];
 
-// Tap dance for number 6 - tap for 6, double-hold for backspace functionality
-void on_dance_6(tap_dance_state_t *state, void *user_data);
-void dance_6_bsp_finished(tap_dance_state_t *state, void *user_data);
-void dance_6_bsp_reset(tap_dance_state_t *state, void *user_data);
+#define PERF_TD_PRESS(index) td_press_time[index] = timer_read()
+#define PERF_TD_OUTPUT(index) perf_latency(index, timer_elapsed(td_press_time[index]))
+#define PERF_FRAME_SKIPPED() perf.frames_skipped++
 
-void on_dance_6(tap_dance_state_t *state, void *user_data) {
-    if(state->count == 3) {
-        tap_code16(KC_6);
-        tap_code16(KC_6);
-        tap_code16(KC_6);
-    }
-    if(state->count > 3) {
-        tap_code16(KC_6);
-    }
-}
+void perf_latency(uint8_t row, uint16_t elapsed);
 
-void dance_6_bsp_finished(tap_dance_state_t *state, void *user_data) {
-    tap_state[5].step = get_tap_dance_step(state);
-    switch (tap_state[5].step) {
-        case SINGLE_TAP: register_code16(KC_6); break;
-        case DOUBLE_TAP: register_code16(KC_6); register_code16(KC_6); break;
-        case DOUBLE_HOLD: layer_move(_BASE); break;
-        case DOUBLE_SINGLE_TAP: tap_code16(KC_6); register_code16(KC_6);
-    }
+void perf_latency(uint8_t row, uint16_t elapsed) {
+    uint16_t *bucket = &latency_histogram[row][MIN(elapsed / LATENCY_BUCKET_MS, LATENCY_BUCKETS - 1)];
+    if (*bucket < UINT16_MAX) (*bucket)++;
 }
 
-void dance_6_bsp_reset(tap_dance_state_t *state, void *user_data) {
-    wait_ms(10);
-    switch (tap_state[5].step) {
-        case SINGLE_TAP: unregister_code16(KC_6); break;
-        case DOUBLE_TAP: unregister_code16(KC_6); break;
-        case DOUBLE_HOLD: break; // No unregister needed for layer move
-        case DOUBLE_SINGLE_TAP: unregister_code16(KC_6); break;
-    }
-    tap_state[5].step = 0;
+void perf_reset(void) {
+    memset(&perf, 0, sizeof(perf));
+    memset(latency_histogram, 0, sizeof(latency_histogram));
+    perf_last_loop = perf_window_start = perf_now();
+    perf_window_scans = 0;
 }
 
-// Tap dance for 9/Minus - tap for 9, double-tap and hold for minus
-void on_dance_9(tap_dance_state_t *state, void *user_data);
-void dance_9_min_finished(tap_dance_state_t *state, void *user_data);
-void dance_9_min_reset(tap_dance_state_t *state, void *user_data);
-
-void on_dance_9(tap_dance_state_t *state, void *user_data) {
-    if(state->count == 3) {
-        tap_code16(KC_9);
-        tap_code16(KC_9);
-        tap_code16(KC_9);
-    }
-    if(state->count > 3) {
-        tap_code16(KC_9);
+// Trace replay for latency benchmarks. tools/reverie-hid uploads a recorded
+// typing trace of keymap keycodes; each is injected as a key event at the
+// matrix position holding that keycode on the trace's layer, with the
+// recorded timing, so the whole keymap runs exactly as it would for a typist.
+// A trace with a keycode that is not on its layer is refused as a whole, and
+// the reply names the first such event.
+#define TRACE_MAX_EVENTS 256
+#define TRACE_PRESSED 0x8000
+
+typedef struct __attribute__((packed)) {
+    uint16_t keycode;
+    uint16_t delay; // ms since the previous event, | TRACE_PRESSED for a press
+} trace_event_t;
+
+static trace_event_t trace[TRACE_MAX_EVENTS];
+static uint16_t trace_length = 0;
+static uint16_t trace_position = 0;
+static uint8_t trace_layer = 0;
+static layer_state_t trace_saved_layers = 0;
+static deferred_token trace_token = INVALID_DEFERRED_TOKEN;
+
+bool trace_locate(uint8_t layer, uint16_t keycode, keypos_t *key);
+uint16_t trace_unresolved(uint8_t layer, uint16_t length);
+void trace_inject(const trace_event_t *event);
+uint32_t trace_callback(uint32_t trigger_time, void *cb_arg);
+bool trace_start(uint8_t layer, uint16_t length);
+
+bool trace_locate(uint8_t layer, uint16_t keycode, keypos_t *key) {
+    for (uint8_t row = 0; row < MATRIX_ROWS; row++) {
+        for (uint8_t col = 0; col < MATRIX_COLS; col++) {
+            if (keycode_at_keymap_location(layer, row, col) == keycode) {
+                *key = (keypos_t){.row = row, .col = col};
+                return true;
+            }
+        }
     }
+    return false;
 }
 
-void dance_9_min_finished(tap_dance_state_t *state, void *user_data) {
-    tap_state[6].step = get_tap_dance_step(state);
-    switch (tap_state[6].step) {
-        case SINGLE_TAP: register_code16(KC_9); break;
-        case DOUBLE_TAP: register_code16(KC_9); register_code16(KC_9); break;
-        case DOUBLE_HOLD: register_code16(KC_MINS); break;
-        case DOUBLE_SINGLE_TAP: tap_code16(KC_9); register_code16(KC_9);
+// Index of the first event whose keycode is not on the layer, or length
+uint16_t trace_unresolved(uint8_t layer, uint16_t length) {
+    keypos_t key;
+    for (uint16_t i = 0; i < length; i++) {
+        if (!trace_locate(layer, trace[i].keycode, &key)) return i;
     }
+    return length;
 }
 
-void dance_9_min_reset(tap_dance_state_t *state, void *user_data) {
-    wait_ms(10);
-    switch (tap_state[6].step) {
-        case SINGLE_TAP: unregister_code16(KC_9); break;
-        case DOUBLE_TAP: unregister_code16(KC_9); break;
-        case DOUBLE_HOLD: unregister_code16(KC_MINS); break;
-        case DOUBLE_SINGLE_TAP: unregister_code16(KC_9); break;
+void trace_inject(const trace_event_t *event) {
+    keypos_t key;
+    if (trace_locate(trace_layer, event->keycode, &key)) {
+        action_exec(MAKE_KEYEVENT(key.row, key.col, (event->delay & TRACE_PRESSED) != 0));
     }
-    tap_state[6].step = 0;
 }
 
-// Left Control tap dance - tap for Left Control, double-hold to return to base layer
-void on_dance_lctl_base(tap_dance_state_t *state, void *user_data);
-void dance_lctl_base_finished(tap_dance_state_t *state, void *user_data);
-void dance_lctl_base_reset(tap_dance_state_t *state, void *user_data);
+uint32_t trace_callback(uint32_t trigger_time, void *cb_arg) {
+    do {
+        trace_inject(&trace[trace_position++]);
+    } while (trace_position < trace_length && (trace[trace_position].delay & ~TRACE_PRESSED) == 0);
 
-void on_dance_lctl_base(tap_dance_state_t *state, void *user_data) {
-    // No special multi-tap functionality needed for this one
-}
-
-void dance_lctl_base_finished(tap_dance_state_t *state, void *user_data) {
-    tap_state[7].step = get_tap_dance_step(state);
-    switch (tap_state[7].step) {
-        case SINGLE_TAP: register_code16(KC_LCTL); break;
-        case SINGLE_HOLD: register_code16(KC_LCTL); break;
-        case DOUBLE_TAP: register_code16(KC_LCTL); register_code16(KC_LCTL); break;
-        case DOUBLE_HOLD: layer_move(_BASE); break;
-        case DOUBLE_SINGLE_TAP: tap_code16(KC_LCTL); register_code16(KC_LCTL);
+    if (trace_position == trace_length) {
+        layer_state_set(trace_saved_layers);
+        trace_token = INVALID_DEFERRED_TOKEN;
+        return 0;
     }
+    return trace[trace_position].delay & ~TRACE_PRESSED;
 }
 
-void dance_lctl_base_reset(tap_dance_state_t *state, void *user_data) {
-    wait_ms(10);
-    switch (tap_state[7].step) {
-        case SINGLE_TAP: unregister_code16(KC_LCTL); break;
-        case SINGLE_HOLD: unregister_code16(KC_LCTL); break;
-        case DOUBLE_TAP: unregister_code16(KC_LCTL); break;
-        case DOUBLE_SINGLE_TAP: unregister_code16(KC_LCTL); break;
-    }
-    tap_state[7].step = 0;
+bool trace_start(uint8_t layer, uint16_t length) {
+    if (trace_token != INVALID_DEFERRED_TOKEN || length == 0 || length > TRACE_MAX_EVENTS) return false;
+    if (trace_unresolved(layer, length) != length) return false;
+
+    trace_layer = layer;
+    trace_length = length;
+    trace_position = 0;
+    trace_saved_layers = layer_state;
+    layer_move(layer);
+    trace_token = defer_exec(MAX(trace[0].delay & ~TRACE_PRESSED, 1), trace_callback, NULL);
+    return trace_token != INVALID_DEFERRED_TOKEN;
 }
 
-// 0 key tap dance - tap for 0, double-tap and hold for equals
-void on_dance_0(tap_dance_state_t *state, void *user_data);
-void dance_0_eq_finished(tap_dance_state_t *state, void *user_data);
-void dance_0_eq_reset(tap_dance_state_t *state, void *user_data);
-
-void on_dance_0(tap_dance_state_t *state, void *user_data) {
-    if(state->count == 3) {
-        tap_code16(KC_0);
-        tap_code16(KC_0);
-        tap_code16(KC_0);
-    }
-    if(state->count > 3) {
-        tap_code16(KC_0);
+#else
+#define PERF_BEGIN(tag)
+#define PERF_END(hook)
+#define PERF_TD_PRESS(index)
+#define PERF_TD_OUTPUT(index)
+#define PERF_FRAME_SKIPPED()
+#endif
+
+// -------------
+// Usage heatmap
+// -------------
+
+// Built with HEATMAP_ENABLE = yes in rules.mk. Counts presses per layer and
+// matrix position and the outcome of every table-driven tap dance in RAM;
+// a press costs two saturating increments in process_record_user() and
+// nothing is done per scan. The counts are written to the user EEPROM
+// datablock at most every HEATMAP_SAVE_INTERVAL ms, once the keyboard has been
+// idle for HEATMAP_SAVE_IDLE ms, and read with tools/reverie-hid heatmap.
+#ifdef HEATMAP_ENABLE
+#    define HEATMAP_MAGIC 0x4D48 // "HM", bump when heatmap_t changes
+#    define HEATMAP_TD_OUTCOMES 8 // tap dance step, SINGLE_TAP..MORE_TAPS
+
+// Wire format read by tools/reverie-hid, keep the two in sync
+typedef struct __attribute__((packed)) {
+    uint16_t presses[LAST_LAYER + 1][MATRIX_ROWS][MATRIX_COLS];
+    uint16_t tap_dances[TD_COUNT][HEATMAP_TD_OUTCOMES];
+} heatmap_t;
+
+typedef struct __attribute__((packed)) {
+    uint16_t magic;
+    heatmap_t counts;
+} heatmap_store_t;
+
+_Static_assert(sizeof(heatmap_store_t) <= HEATMAP_STORE_SIZE, "HEATMAP_STORE_SIZE too small");
+
+static heatmap_store_t heatmap;
+static bool heatmap_dirty = false;
+static uint32_t heatmap_saved = 0;
+
+#    define HEATMAP_COUNT(counter)          \
+        do {                                \
+            if ((counter) < UINT16_MAX) {   \
+                (counter)++;                \
+            }                               \
+            heatmap_dirty = true;           \
+        } while (0)
+
+void heatmap_load(void) {
+    eeconfig_read_user_datablock(&heatmap, HEATMAP_STORE_OFFSET, sizeof(heatmap));
+    if (heatmap.magic != HEATMAP_MAGIC) {
+        memset(&heatmap, 0, sizeof(heatmap));
+        heatmap.magic = HEATMAP_MAGIC;
     }
 }
 
-void dance_0_eq_finished(tap_dance_state_t *state, void *user_data) {
-    tap_state[8].step = get_tap_dance_step(state);
-    switch (tap_state[8].step) {
-        case SINGLE_TAP: register_code16(KC_0); break;
-        case DOUBLE_TAP: register_code16(KC_0); register_code16(KC_0); break;
-        case DOUBLE_HOLD: register_code16(KC_EQL); break;
-        case DOUBLE_SINGLE_TAP: tap_code16(KC_0); register_code16(KC_0);
-    }
+void heatmap_reset(void) {
+    memset(&heatmap.counts, 0, sizeof(heatmap.counts));
+    heatmap_dirty = true;
 }
 
-void dance_0_eq_reset(tap_dance_state_t *state, void *user_data) {
-    wait_ms(10);
-    switch (tap_state[8].step) {
-        case SINGLE_TAP: unregister_code16(KC_0); break;
-        case DOUBLE_TAP: unregister_code16(KC_0); break;
-        case DOUBLE_HOLD: unregister_code16(KC_EQL); break;
-        case DOUBLE_SINGLE_TAP: unregister_code16(KC_0); break;
+void heatmap_press(uint8_t layer, keypos_t key) {
+    if (layer <= LAST_LAYER && key.row < MATRIX_ROWS && key.col < MATRIX_COLS) {
+        HEATMAP_COUNT(heatmap.counts.presses[layer][key.row][key.col]);
     }
-    tap_state[8].step = 0;
 }
 
-// Enter or Backslash tap dance functions
-void on_dance_ent_bsls(tap_dance_state_t *state, void *user_data) {
-    if (state->count == 3) {
-        tap_code16(KC_ENT);
-        tap_code16(KC_ENT);
-    }
-    if (state->count > 3) {
-        tap_code16(KC_ENT);
+void heatmap_tap_dance(uint8_t index, uint8_t step) {
+    if (step < HEATMAP_TD_OUTCOMES) {
+        HEATMAP_COUNT(heatmap.counts.tap_dances[index][step]);
     }
 }
 
-void dance_ent_bsls_finished(tap_dance_state_t *state, void *user_data) {
-    tap_state[9].step = get_tap_dance_step(state);
-    switch (tap_state[9].step) {
-        case SINGLE_TAP: register_code16(KC_ENT); break;
-        case SINGLE_HOLD: register_code16(KC_ENT); break;
-        case DOUBLE_TAP: register_code16(KC_ENT); break;
-        case DOUBLE_HOLD: register_code16(KC_BSLS); break;
-        case DOUBLE_SINGLE_TAP: tap_code16(KC_ENT); register_code16(KC_ENT);
+void heatmap_task(void) {
+    if (heatmap_dirty && timer_elapsed32(heatmap_saved) >= HEATMAP_SAVE_INTERVAL && last_input_activity_elapsed() >= HEATMAP_SAVE_IDLE) {
+        eeconfig_update_user_datablock(&heatmap, HEATMAP_STORE_OFFSET, sizeof(heatmap));
+        heatmap_dirty = false;
+        heatmap_saved = timer_read32();
     }
 }
+#endif
 
-void dance_ent_bsls_reset(tap_dance_state_t *state, void *user_data) {
-    wait_ms(10);
-    switch (tap_state[9].step) {
-        case SINGLE_TAP: unregister_code16(KC_ENT); break;
-        case SINGLE_HOLD: unregister_code16(KC_ENT); break;
-        case DOUBLE_TAP: unregister_code16(KC_ENT); break;
-        case DOUBLE_HOLD: unregister_code16(KC_BSLS); break;
-        case DOUBLE_SINGLE_TAP: unregister_code16(KC_ENT); break;
-    }
-    tap_state[9].step = 0;
-}
+// Helper functions for advanced tap dance
+enum {
+    SINGLE_TAP = 1,
+    SINGLE_HOLD,
+    DOUBLE_TAP,
+    DOUBLE_HOLD,
+    DOUBLE_SINGLE_TAP,
+    MORE_TAPS
+};
 
-// Backslash or Right Shift tap dance functions
-void on_dance_bsls_rsft(tap_dance_state_t *state, void *user_data) {
-    if (state->count == 3) {
-        tap_code16(KC_BSLS);
-        tap_code16(KC_BSLS);
-    }
-    if (state->count > 3) {
-        tap_code16(KC_BSLS);
-    }
-}
+// Forward declaration
+tap_dance_action_t tap_dance_actions[];
 
-void dance_bsls_rsft_finished(tap_dance_state_t *state, void *user_data) {
-    tap_state[10].step = get_tap_dance_step(state);
-    switch (tap_state[10].step) {
-        case SINGLE_TAP: register_code16(KC_BSLS); break;
-        case SINGLE_HOLD: register_code16(KC_BSLS); break;
-        case DOUBLE_TAP: register_code16(KC_BSLS); break;
-        case DOUBLE_HOLD: register_code16(KC_RSFT); break;
-        case DOUBLE_SINGLE_TAP: tap_code16(KC_BSLS); register_code16(KC_BSLS);
-    }
+// Deferred key releases for tap dances. A dance that finishes after its key
+// is already up registers and releases its keycode back to back, so the
+// release is queued and sent TAP_RELEASE_DELAY ms later from the scan loop
+// instead of busy-waiting. Any new key press flushes the queue first so a
+// queued modifier never leaks onto the next key.
+typedef struct {
+    uint16_t keycode;
+    uint16_t time;
+} pending_release_t;
+
+static pending_release_t release_queue[RELEASE_QUEUE_SIZE];
+static uint8_t release_head = 0;
+static uint8_t release_count = 0;
+
+void release_queue_pop(void);
+void schedule_release(uint16_t keycode);
+void release_queue_flush(void);
+void release_queue_task(void);
+
+HOT_PATH void release_queue_pop(void) {
+    unregister_code16(release_queue[release_head].keycode);
+    release_head = (release_head + 1) % RELEASE_QUEUE_SIZE;
+    release_count--;
 }
 
-void dance_bsls_rsft_reset(tap_dance_state_t *state, void *user_data) {
-    wait_ms(10);
-    switch (tap_state[10].step) {
-        case SINGLE_TAP: unregister_code16(KC_BSLS); break;
-        case SINGLE_HOLD: unregister_code16(KC_BSLS); break;
-        case DOUBLE_TAP: unregister_code16(KC_BSLS); break;
-        case DOUBLE_HOLD: unregister_code16(KC_RSFT); break;
-        case DOUBLE_SINGLE_TAP: unregister_code16(KC_BSLS); break;
+HOT_PATH void schedule_release(uint16_t keycode) {
+    if (release_count == RELEASE_QUEUE_SIZE) {
+        release_queue_pop();
     }
-    tap_state[10].step = 0;
+    uint8_t tail = (release_head + release_count) % RELEASE_QUEUE_SIZE;
+    release_queue[tail].keycode = keycode;
+    release_queue[tail].time = timer_read();
+    release_count++;
 }
 
-// Left Control or Gaming layer tap dance functions
-void on_dance_lctl_game(tap_dance_state_t *state, void *user_data) {
-    if (state->count == 3) {
-        tap_code16(KC_LCTL);
-        tap_code16(KC_LCTL);
-    }
-    if (state->count > 3) {
-        tap_code16(KC_LCTL);
+HOT_PATH void release_queue_flush(void) {
+    while (release_count) {
+        release_queue_pop();
     }
 }
 
-void dance_lctl_game_finished(tap_dance_state_t *state, void *user_data) {
-    tap_state[11].step = get_tap_dance_step(state);
-    switch (tap_state[11].step) {
-        case SINGLE_TAP: register_code16(KC_LCTL); break;
-        case SINGLE_HOLD: register_code16(KC_LCTL); break;
-        case DOUBLE_TAP: register_code16(KC_LCTL); break;
-        case DOUBLE_HOLD: layer_move(_GAMING); break;
-        case DOUBLE_SINGLE_TAP: tap_code16(KC_LCTL); register_code16(KC_LCTL);
+HOT_PATH void release_queue_task(void) {
+    while (release_count && timer_elapsed(release_queue[release_head].time) >= tuning.tap_release_delay) {
+        release_queue_pop();
     }
 }
 
-void dance_lctl_game_reset(tap_dance_state_t *state, void *user_data) {
-    wait_ms(10);
-    switch (tap_state[11].step) {
-        case SINGLE_TAP: unregister_code16(KC_LCTL); break;
-        case DOUBLE_TAP: unregister_code16(KC_LCTL); break;
-        case DOUBLE_HOLD: break; // No need to unregister layer move
-        case DOUBLE_SINGLE_TAP: unregister_code16(KC_LCTL); break;
-    }
-    tap_state[11].step = 0;
-}
+uint8_t get_tap_dance_step(tap_dance_state_t *state);
 
-// Media Previous or Browser Back tap dance functions
-void on_dance_media_prev(tap_dance_state_t *state, void *user_data) {
-    if (state->count == 3) {
-        tap_code16(KC_MEDIA_PREV_TRACK);
-        tap_code16(KC_MEDIA_PREV_TRACK);
-        tap_code16(KC_MEDIA_PREV_TRACK);
-    }
-    if (state->count > 3) {
-        tap_code16(KC_MEDIA_PREV_TRACK);
+HOT_PATH uint8_t get_tap_dance_step(tap_dance_state_t *state) {
+    if (state->count == 1) {
+        if (state->interrupted || !state->pressed) return SINGLE_TAP;
+        else return SINGLE_HOLD;
+    } else if (state->count == 2) {
+        if (state->interrupted) return DOUBLE_SINGLE_TAP;
+        else if (state->pressed) return DOUBLE_HOLD;
+        else return DOUBLE_TAP;
     }
+    return MORE_TAPS;
 }
 
-void dance_media_prev_finished(tap_dance_state_t *state, void *user_data) {
-    tap_state[12].step = get_tap_dance_step(state);
-    switch (tap_state[12].step) {
-        case SINGLE_TAP: register_code16(KC_MEDIA_PREV_TRACK); break;
-        case DOUBLE_TAP: register_code16(KC_WWW_BACK); break;
-        case DOUBLE_SINGLE_TAP: tap_code16(KC_MEDIA_PREV_TRACK); register_code16(KC_MEDIA_PREV_TRACK);
-    }
-}
+// Generic tap-dance engine. Every advanced dance is described by one entry in
+// td_descriptors; the shared callbacks below look up the entry through the
+// action's user_data instead of each dance carrying its own callback triplet.
+enum td_flags {
+    TD_LAYER_MOVE = 1 << 0, // double_hold is a layer for layer_move(), not a keycode
+    TD_BURST      = 1 << 1, // a third tap sends the tap keycode three times, later taps once each
+    TD_SPECULATIVE = 1 << 2, // every tap sends the tap keycode at once, a double hold backspaces them
+};
 
-void dance_media_prev_reset(tap_dance_state_t *state, void *user_data) {
-    wait_ms(10);
-    switch (tap_state[12].step) {
-        case SINGLE_TAP: unregister_code16(KC_MEDIA_PREV_TRACK); break;
-        case DOUBLE_TAP: unregister_code16(KC_WWW_BACK); break;
-        case DOUBLE_SINGLE_TAP: unregister_code16(KC_MEDIA_PREV_TRACK); break;
-    }
-    tap_state[12].step = 0;
-}
+typedef struct {
+    uint16_t tap;         // single tap, and each tap of a double-single-tap
+    uint16_t hold;        // held after one tap, KC_NO to send nothing
+    uint16_t double_tap;  // double tap
+    uint16_t double_hold; // held after two taps: keycode, or layer with TD_LAYER_MOVE
+    uint8_t flags;
+} td_descriptor_t;
+
+#ifdef TD_SPECULATIVE_DIGITS
+#    define TD_DIGIT(kc, layer) {kc, KC_NO, kc, layer, TD_LAYER_MOVE | TD_SPECULATIVE}
+#else
+#    define TD_DIGIT(kc, layer) {kc, KC_NO, kc, layer, TD_LAYER_MOVE | TD_BURST}
+#endif
+
+const td_descriptor_t PROGMEM td_descriptors[TD_COUNT] = {
+    [TD_1_FN]       = TD_DIGIT(KC_1, _FUNCTION),
+    [TD_2_NUM]      = TD_DIGIT(KC_2, _NUMBERS),
+    [TD_3_SYS]      = TD_DIGIT(KC_3, _SYSTEM),
+    [TD_4_GAME]     = TD_DIGIT(KC_4, _GAMING),
+    [TD_5_MACRO]    = TD_DIGIT(KC_5, _MACRO),
+    [TD_6_BS]       = TD_DIGIT(KC_6, _BASE),
+    [TD_MEDIA_PREV] = {KC_MEDIA_PREV_TRACK, KC_NO, KC_WWW_BACK, KC_NO, TD_BURST},
+    [TD_MEDIA_PLAY] = {KC_MEDIA_PLAY_PAUSE, KC_NO, KC_WWW_HOME, KC_NO, TD_BURST},
+    [TD_MEDIA_NEXT] = {KC_MEDIA_NEXT_TRACK, KC_NO, KC_WWW_FORWARD, KC_NO, TD_BURST},
+    [TD_LCTL_BASE]  = {KC_LCTL, KC_LCTL, KC_LCTL, _BASE, TD_LAYER_MOVE},
+    [TD_LGUI_ALT]   = {KC_LGUI, KC_LGUI, KC_LGUI, KC_LALT, TD_BURST},
+    [TD_RALT_CTRL]  = {KC_RALT, KC_RALT, KC_RALT, KC_RCTL, TD_BURST},
+};
 
-// Media Play/Pause or Browser Home tap dance functions
-void on_dance_media_play(tap_dance_state_t *state, void *user_data) {
-    if (state->count == 3) {
-        tap_code16(KC_MEDIA_PLAY_PAUSE);
-        tap_code16(KC_MEDIA_PLAY_PAUSE);
-        tap_code16(KC_MEDIA_PLAY_PAUSE);
-    }
-    if (state->count > 3) {
-        tap_code16(KC_MEDIA_PLAY_PAUSE);
-    }
-}
+// Resolved step per dance, packed two 4-bit steps to a byte
+static uint8_t td_steps[(TD_COUNT + 1) / 2];
 
-void dance_media_play_finished(tap_dance_state_t *state, void *user_data) {
-    tap_state[13].step = get_tap_dance_step(state);
-    switch (tap_state[13].step) {
-        case SINGLE_TAP: register_code16(KC_MEDIA_PLAY_PAUSE); break;
-        case DOUBLE_TAP: register_code16(KC_WWW_HOME); break;
-        case DOUBLE_SINGLE_TAP: tap_code16(KC_MEDIA_PLAY_PAUSE); register_code16(KC_MEDIA_PLAY_PAUSE);
-    }
-}
+uint8_t td_get_step(uint8_t index);
+void td_set_step(uint8_t index, uint8_t step);
+uint8_t td_index(void *user_data);
+void td_load(void *user_data, td_descriptor_t *td);
 
-void dance_media_play_reset(tap_dance_state_t *state, void *user_data) {
-    wait_ms(10);
-    switch (tap_state[13].step) {
-        case SINGLE_TAP: unregister_code16(KC_MEDIA_PLAY_PAUSE); break;
-        case DOUBLE_TAP: unregister_code16(KC_WWW_HOME); break;
-        case DOUBLE_SINGLE_TAP: unregister_code16(KC_MEDIA_PLAY_PAUSE); break;
-    }
-    tap_state[13].step = 0;
+HOT_PATH uint8_t td_get_step(uint8_t index) {
+    return (td_steps[index >> 1] >> ((index & 1) << 2)) & 0x0F;
 }
 
-// Media Next or Browser Forward tap dance functions
-void on_dance_media_next(tap_dance_state_t *state, void *user_data) {
-    if (state->count == 3) {
-        tap_code16(KC_MEDIA_NEXT_TRACK);
-        tap_code16(KC_MEDIA_NEXT_TRACK);
-        tap_code16(KC_MEDIA_NEXT_TRACK);
-    }
-    if (state->count > 3) {
-        tap_code16(KC_MEDIA_NEXT_TRACK);
-    }
+HOT_PATH void td_set_step(uint8_t index, uint8_t step) {
+    uint8_t shift = (index & 1) << 2;
+    td_steps[index >> 1] = (td_steps[index >> 1] & ~(0x0F << shift)) | (step << shift);
 }
 
-void dance_media_next_finished(tap_dance_state_t *state, void *user_data) {
-    tap_state[14].step = get_tap_dance_step(state);
-    switch (tap_state[14].step) {
-        case SINGLE_TAP: register_code16(KC_MEDIA_NEXT_TRACK); break;
-        case DOUBLE_TAP: register_code16(KC_WWW_FORWARD); break;
-        case DOUBLE_SINGLE_TAP: tap_code16(KC_MEDIA_NEXT_TRACK); register_code16(KC_MEDIA_NEXT_TRACK);
-    }
+HOT_PATH uint8_t td_index(void *user_data) {
+    return (const td_descriptor_t *)user_data - td_descriptors;
 }
 
-void dance_media_next_reset(tap_dance_state_t *state, void *user_data) {
-    wait_ms(10);
-    switch (tap_state[14].step) {
-        case SINGLE_TAP: unregister_code16(KC_MEDIA_NEXT_TRACK); break;
-        case DOUBLE_TAP: unregister_code16(KC_WWW_FORWARD); break;
-        case DOUBLE_SINGLE_TAP: unregister_code16(KC_MEDIA_NEXT_TRACK); break;
-    }
-    tap_state[14].step = 0;
+HOT_PATH void td_load(void *user_data, td_descriptor_t *td) {
+    memcpy_P(td, user_data, sizeof(td_descriptor_t));
 }
 
-// Left GUI or Left Alt tap dance functions
-void on_dance_lgui_alt(tap_dance_state_t *state, void *user_data) {
-    if (state->count == 3) {
-        tap_code16(KC_LGUI);
-        tap_code16(KC_LGUI);
-        tap_code16(KC_LGUI);
-    }
-    if (state->count > 3) {
-        tap_code16(KC_LGUI);
-    }
+// Takes back count speculative taps. The backspaces go out without the held
+// modifiers, so Ctrl or Alt can't turn them into a word delete.
+void td_retract(uint8_t count);
+
+HOT_PATH void td_retract(uint8_t count) {
+    uint8_t mods = get_mods();
+    uint8_t weak_mods = get_weak_mods();
+    clear_mods();
+    clear_weak_mods();
+    send_keyboard_report();
+    for (uint8_t i = 0; i < count; i++) {
+        tap_code(KC_BSPC);
+    }
+    set_mods(mods);
+    set_weak_mods(weak_mods);
+    send_keyboard_report();
 }
 
-void dance_lgui_alt_finished(tap_dance_state_t *state, void *user_data) {
-    tap_state[15].step = get_tap_dance_step(state);
-    switch (tap_state[15].step) {
-        case SINGLE_TAP: register_code16(KC_LGUI); break;
-        case SINGLE_HOLD: register_code16(KC_LGUI); break;
-        case DOUBLE_TAP: register_code16(KC_LGUI); register_code16(KC_LGUI); break;
-        case DOUBLE_HOLD: register_code16(KC_LALT); break;
-        case DOUBLE_SINGLE_TAP: tap_code16(KC_LGUI); register_code16(KC_LGUI);
-    }
-}
+void td_on_each_tap(tap_dance_state_t *state, void *user_data);
+void td_finished(tap_dance_state_t *state, void *user_data);
+void td_reset(tap_dance_state_t *state, void *user_data);
 
-void dance_lgui_alt_reset(tap_dance_state_t *state, void *user_data) {
-    wait_ms(10);
-    switch (tap_state[15].step) {
-        case SINGLE_TAP: unregister_code16(KC_LGUI); break;
-        case SINGLE_HOLD: unregister_code16(KC_LGUI); break;
-        case DOUBLE_TAP: unregister_code16(KC_LGUI); break;
-        case DOUBLE_HOLD: unregister_code16(KC_LALT); break;
-        case DOUBLE_SINGLE_TAP: unregister_code16(KC_LGUI); break;
-    }
-    tap_state[15].step = 0;
+HOT_PATH void td_on_each_tap(tap_dance_state_t *state, void *user_data) {
+    PERF_BEGIN(PERF_TAG_TAP_DANCE | td_index(user_data));
+    td_descriptor_t td;
+    td_load(user_data, &td);
+    if (state->count == 1) {
+        PERF_TD_PRESS(td_index(user_data));
+    }
+
+    if (td.flags & TD_SPECULATIVE) {
+        tap_code16(td.tap);
+        if (state->count == 1) {
+            PERF_TD_OUTPUT(td_index(user_data));
+        }
+    } else if (td.flags & TD_BURST) {
+        if (state->count == 3) {
+            tap_code16(td.tap);
+            tap_code16(td.tap);
+            tap_code16(td.tap);
+        }
+        if (state->count > 3) {
+            tap_code16(td.tap);
+        }
+    }
+    PERF_END(PERF_HOOK_TAP_DANCE);
 }
 
-// Right Alt or Right Control tap dance functions
-void on_dance_ralt_ctrl(tap_dance_state_t *state, void *user_data) {
-    if (state->count == 3) {
-        tap_code16(KC_RALT);
-        tap_code16(KC_RALT);
-        tap_code16(KC_RALT);
-    }
-    if (state->count > 3) {
-        tap_code16(KC_RALT);
-    }
+HOT_PATH void td_finished(tap_dance_state_t *state, void *user_data) {
+    PERF_BEGIN(PERF_TAG_TAP_DANCE | td_index(user_data));
+    td_descriptor_t td;
+    td_load(user_data, &td);
+    uint8_t step = get_tap_dance_step(state);
+    td_set_step(td_index(user_data), step);
+#ifdef HEATMAP_ENABLE
+    heatmap_tap_dance(td_index(user_data), step);
+#endif
+
+    // Speculative taps were already sent from td_on_each_tap(); only a double
+    // hold has anything left to do, and it takes its taps back first
+    if (td.flags & TD_SPECULATIVE) {
+        if (step == DOUBLE_HOLD) {
+            td_retract(state->count);
+            layer_move(td.double_hold);
+        }
+        td_set_step(td_index(user_data), 0);
+        PERF_END(PERF_HOOK_TAP_DANCE);
+        return;
+    }
+
+    if (step != MORE_TAPS) {
+        PERF_TD_OUTPUT(td_index(user_data));
+    }
+
+    switch (step) {
+        case SINGLE_TAP: register_code16(td.tap); break;
+        case SINGLE_HOLD: if (td.hold != KC_NO) register_code16(td.hold); break;
+        case DOUBLE_TAP: register_code16(td.double_tap); break;
+        case DOUBLE_HOLD:
+            if (td.flags & TD_LAYER_MOVE) layer_move(td.double_hold);
+            else if (td.double_hold != KC_NO) register_code16(td.double_hold);
+            break;
+        case DOUBLE_SINGLE_TAP: tap_code16(td.tap); register_code16(td.tap); break;
+    }
+    PERF_END(PERF_HOOK_TAP_DANCE);
 }
 
-void dance_ralt_ctrl_finished(tap_dance_state_t *state, void *user_data) {
-    tap_state[16].step = get_tap_dance_step(state);
-    switch (tap_state[16].step) {
-        case SINGLE_TAP: register_code16(KC_RALT); break;
-        case SINGLE_HOLD: register_code16(KC_RALT); break;
-        case DOUBLE_TAP: register_code16(KC_RALT); register_code16(KC_RALT); break;
-        case DOUBLE_HOLD: register_code16(KC_RCTL); break;
-        case DOUBLE_SINGLE_TAP: tap_code16(KC_RALT); register_code16(KC_RALT);
-    }
+HOT_PATH void td_reset(tap_dance_state_t *state, void *user_data) {
+    PERF_BEGIN(PERF_TAG_TAP_DANCE | td_index(user_data));
+    td_descriptor_t td;
+    td_load(user_data, &td);
+    uint8_t index = td_index(user_data);
+
+    switch (td_get_step(index)) {
+        case SINGLE_TAP: schedule_release(td.tap); break;
+        case SINGLE_HOLD: if (td.hold != KC_NO) schedule_release(td.hold); break;
+        case DOUBLE_TAP: schedule_release(td.double_tap); break;
+        case DOUBLE_HOLD:
+            if (!(td.flags & TD_LAYER_MOVE) && td.double_hold != KC_NO) schedule_release(td.double_hold);
+            break;
+        case DOUBLE_SINGLE_TAP: schedule_release(td.tap); break;
+    }
+    td_set_step(index, 0);
+    PERF_END(PERF_HOOK_TAP_DANCE);
 }
 
-void dance_ralt_ctrl_reset(tap_dance_state_t *state, void *user_data) {
-    wait_ms(10);
-    switch (tap_state[16].step) {
-        case SINGLE_TAP: unregister_code16(KC_RALT); break;
-        case SINGLE_HOLD: unregister_code16(KC_RALT); break;
-        case DOUBLE_TAP: unregister_code16(KC_RALT); break;
-        case DOUBLE_HOLD: unregister_code16(KC_RCTL); break;
-        case DOUBLE_SINGLE_TAP: unregister_code16(KC_RALT); break;
-    }
-    tap_state[16].step = 0;
-}
+#define ACTION_TAP_DANCE_TABLE(index) \
+    { .fn = {td_on_each_tap, td_finished, td_reset}, .user_data = (void *)&td_descriptors[index] }
 
 tap_dance_action_t tap_dance_actions[] = {
     [TD_LSFT_CAPS] = ACTION_TAP_DANCE_DOUBLE(KC_LSFT, KC_CAPS),
     [TD_GRV_ESC]   = ACTION_TAP_DANCE_DOUBLE(KC_GRV, KC_ESC),
 
-    [TD_1_FN]      = ACTION_TAP_DANCE_FN_ADVANCED(on_dance_1, dance_1_fn_finished, dance_1_fn_reset),  // 1 tap, double-hold for FUNCTION layer
-    [TD_2_NUM]     = ACTION_TAP_DANCE_FN_ADVANCED(on_dance_2, dance_2_num_finished, dance_2_num_reset),   // 2 tap, double-hold for NUMBERS layer
-    [TD_3_SYS]     = ACTION_TAP_DANCE_FN_ADVANCED(on_dance_3, dance_3_sys_finished, dance_3_sys_reset),    // 3 tap, double-hold for SYSTEM layer
-    [TD_4_GAME]    = ACTION_TAP_DANCE_FN_ADVANCED(on_dance_4, dance_4_game_finished, dance_4_game_reset),    // 4 tap, double-hold for GAMING layer
-    [TD_5_MACRO]   = ACTION_TAP_DANCE_FN_ADVANCED(on_dance_5, dance_5_macro_finished, dance_5_macro_reset),     // 5 tap, double-hold for MACRO layer
-    [TD_6_BS]      = ACTION_TAP_DANCE_FN_ADVANCED(on_dance_6, dance_6_bsp_finished, dance_6_bsp_reset),       // 6 tap, double-hold for BASE layer
+    [TD_1_FN]      = ACTION_TAP_DANCE_TABLE(TD_1_FN),       // 1 tap, double-hold for FUNCTION layer
+    [TD_2_NUM]     = ACTION_TAP_DANCE_TABLE(TD_2_NUM),      // 2 tap, double-hold for NUMBERS layer
+    [TD_3_SYS]     = ACTION_TAP_DANCE_TABLE(TD_3_SYS),      // 3 tap, double-hold for SYSTEM layer
+    [TD_4_GAME]    = ACTION_TAP_DANCE_TABLE(TD_4_GAME),     // 4 tap, double-hold for GAMING layer
+    [TD_5_MACRO]   = ACTION_TAP_DANCE_TABLE(TD_5_MACRO),    // 5 tap, double-hold for MACRO layer
+    [TD_6_BS]      = ACTION_TAP_DANCE_TABLE(TD_6_BS),       // 6 tap, double-hold for BASE layer
     [TD_9_MIN]     = ACTION_TAP_DANCE_DOUBLE(KC_9, KC_MINS),        // 9 tap, tap-hold for minus
     [TD_0_EQ]      = ACTION_TAP_DANCE_DOUBLE(KC_0, KC_EQL),         // 0 tap, tap-hold for equals
     [TD_ENT_BSLS]  = ACTION_TAP_DANCE_DOUBLE(KC_ENT, KC_BSLS),      // Enter tap, tap-hold for backslash
     [TD_BSLS_RSFT] = ACTION_TAP_DANCE_DOUBLE(KC_BSLS, KC_RSFT),     // Backslash tap, tap-hold for right shift
     [TD_LCTL_GAME] = ACTION_TAP_DANCE_DOUBLE(KC_LCTL, MO(_GAMING)),  // Left Control tap, tap-hold for GAMING layer
-    [TD_MEDIA_PREV] = ACTION_TAP_DANCE_FN_ADVANCED(on_dance_media_prev, dance_media_prev_finished, dance_media_prev_reset),  // Media Previous tap, double-tap for browser back
-    [TD_MEDIA_PLAY] = ACTION_TAP_DANCE_FN_ADVANCED(on_dance_media_play, dance_media_play_finished, dance_media_play_reset),  // Media Play/Pause tap, double-tap for browser home
-    [TD_MEDIA_NEXT] = ACTION_TAP_DANCE_FN_ADVANCED(on_dance_media_next, dance_media_next_finished, dance_media_next_reset),  // Media Next tap, double-tap for browser forward
-    [TD_LCTL_BASE] = ACTION_TAP_DANCE_FN_ADVANCED(on_dance_lctl_base, dance_lctl_base_finished, dance_lctl_base_reset),  // LCTL tap, double-hold for BASE layer
-    [TD_LGUI_ALT] = ACTION_TAP_DANCE_FN_ADVANCED(on_dance_lgui_alt, dance_lgui_alt_finished, dance_lgui_alt_reset),    // LGUI tap, double-hold for left alt
-    [TD_RALT_CTRL] = ACTION_TAP_DANCE_FN_ADVANCED(on_dance_ralt_ctrl, dance_ralt_ctrl_finished, dance_ralt_ctrl_reset),  // RALT tap, double-hold for right control
+    [TD_MEDIA_PREV] = ACTION_TAP_DANCE_TABLE(TD_MEDIA_PREV), // Media Previous tap, double-tap for browser back
+    [TD_MEDIA_PLAY] = ACTION_TAP_DANCE_TABLE(TD_MEDIA_PLAY), // Media Play/Pause tap, double-tap for browser home
+    [TD_MEDIA_NEXT] = ACTION_TAP_DANCE_TABLE(TD_MEDIA_NEXT), // Media Next tap, double-tap for browser forward
+    [TD_LCTL_BASE] = ACTION_TAP_DANCE_TABLE(TD_LCTL_BASE),  // LCTL tap, double-hold for BASE layer
+    [TD_LGUI_ALT]  = ACTION_TAP_DANCE_TABLE(TD_LGUI_ALT),   // LGUI tap, double-hold for left alt
+    [TD_RALT_CTRL] = ACTION_TAP_DANCE_TABLE(TD_RALT_CTRL),  // RALT tap, double-hold for right control
 };
 
 const uint16_t PROGMEM keymaps[][MATRIX_ROWS][MATRIX_COLS] = {
@@ -817,15 +889,15 @@ const uint16_t PROGMEM keymaps[][MATRIX_ROWS][MATRIX_COLS] = {
 
     [_GAMING] = LAYOUT(
     //┌───────────────┬───────────────┬───────────────┬───────────────┬───────────────┬───────────────┐                                        ┌───────────────┬───────────────┬───────────────┬───────────────┬───────────────┬───────────────┐
-       KC_ESC,         KC_1,           KC_2,           KC_3,           KC_4,           KC_5,                                                    KC_6,           KC_7,           KC_8,           TD(TD_9_MIN),   TD(TD_0_EQ),    KC_BSPC,
+       KC_ESC,         KC_1,           KC_2,           KC_3,           KC_4,           KC_5,                                                    KC_6,           KC_7,           KC_8,           GM_9,           GM_0,           KC_BSPC,
     //├───────────────┼───────────────┼───────────────┼───────────────┼───────────────┼───────────────┤                                        ├───────────────┼───────────────┼───────────────┼───────────────┼───────────────┼───────────────┤
-       KC_TAB,         KC_Q,           KC_W,           KC_E,           KC_R,           KC_T,                                                    KC_Y,           KC_U,           KC_I,           KC_O,           KC_P,           TD(TD_ENT_BSLS),
+       KC_TAB,         KC_Q,           KC_W,           KC_E,           KC_R,           KC_T,                                                    KC_Y,           KC_U,           KC_I,           KC_O,           KC_P,           GM_ENT,
     //├───────────────┼───────────────┼───────────────┼───────────────┼───────────────┼───────────────┤                                        ├───────────────┼───────────────┼───────────────┼───────────────┼───────────────┼───────────────┤
        KC_LSFT,        KC_A,           KC_S,           KC_D,           KC_F,           KC_G,                                                    KC_H,           KC_J,           KC_K,           KC_L,           KC_SCLN,        KC_QUOT,
     //├───────────────┼───────────────┼───────────────┼───────────────┼───────────────┼───────────────┼───────────────┐        ┌───────────────┼───────────────┼───────────────┼───────────────┼───────────────┼───────────────┼───────────────┤
-       KC_LCTL,        KC_Z,           KC_X,           KC_C,           KC_V,           KC_B,           KC_LBRC,                 KC_RBRC,        KC_N,           KC_M,           KC_COMM,        KC_DOT,         KC_SLSH,        KC_ENT,
+       KC_LCTL,        KC_Z,           KC_X,           KC_C,           KC_V,           KC_B,           KC_LBRC,                 GM_EXIT,        KC_N,           KC_M,           KC_COMM,        KC_DOT,         KC_SLSH,        KC_ENT,
     //└───────────────┴───────────────┴───────────────┴───────────────┼───────────────┼───────────────┼───────────────┘        └───────────────┼───────────────┼───────────────┼───────────────┴───────────────┴───────────────┴───────────────┘
-                                                                      TD(TD_LGUI_ALT),TD(TD_LCTL_BASE),KC_SPC,                  KC_SPC,         MO_NU,          TD(TD_RALT_CTRL)
+                                                                      GM_LGUI,        GM_LCTL,        KC_SPC,                  KC_SPC,         MO_NU,          GM_RALT
     //                                                                └───────────────┴───────────────┴───────────────┘        └───────────────┴───────────────┴───────────────┘
     ),
 
@@ -837,13 +909,322 @@ const uint16_t PROGMEM keymaps[][MATRIX_ROWS][MATRIX_COLS] = {
     //├───────────────┼───────────────┼───────────────┼───────────────┼───────────────┼───────────────┤                                        ├───────────────┼───────────────┼───────────────┼───────────────┼───────────────┼───────────────┤
        AS_TOGG,          _______,        _______,        _______,        _______,        TURBO,                                                    _______,        JIGGLER,        _______,        _______,        _______,        _______,
     //├───────────────┼───────────────┼───────────────┼───────────────┼───────────────┼───────────────┼───────────────┐        ┌───────────────┼───────────────┼───────────────┼───────────────┼───────────────┼───────────────┼───────────────┤
-      TD(TD_LCTL_BASE),  MU_NEXT,        MU_TOGG,        QK_MUSIC_OFF,   QK_MUSIC_ON,    TO(_GAMING),  _______,                 _______,         _______,       _______,       _______,       _______,       _______,       _______,
+      TD(TD_LCTL_BASE),  MU_NEXT,        MU_TOGG,        QK_MUSIC_OFF,   QK_MUSIC_ON,    TO(_GAMING),  MC_BANK,                 MC_SPEED,        _______,       _______,       _______,       _______,       _______,       _______,
     //└───────────────┴───────────────┴───────────────┴───────────────┼───────────────┼───────────────┼───────────────┘        └───────────────┼───────────────┼───────────────┼───────────────┴───────────────┴───────────────┴───────────────┘
                                                                        DM_REC2,        DM_RSTP,        DM_PLY2,                 DM_REC1,        DM_RSTP,        DM_PLY1
     //                                                                └───────────────┴───────────────┴───────────────┘        └───────────────┴───────────────┴───────────────┘
     )
 };
 
+// ---------------
+// Keymap RAM copy
+// ---------------
+
+// keymaps[] above stays the source of truth: the LAYOUT macros, qmk c2json
+// and keymap-drawer all read it. At boot it is copied into RAM, so a lookup
+// is an array read instead of a flash read through the XIP cache; the copy
+// costs RAM, not flash. Each position also keeps the set of layers it is
+// opaque on, which turns "which layer does this key fall through to" into
+// one AND and a count-leading-zeros. keycode_at_keymap_location() is left to
+// QMK: keymap_introspection.c defines it in the same translation unit as
+// this file, so the RAM copy is read from keymap_key_to_keycode() below.
+#define KEYMAP_LAYERS (LAST_LAYER + 1)
+
+_Static_assert(sizeof(keymaps) / sizeof(keymaps[0]) == KEYMAP_LAYERS, "keymaps[] and LAST_LAYER disagree");
+
+static uint16_t keymap_ram[KEYMAP_LAYERS][MATRIX_ROWS][MATRIX_COLS];
+static layer_state_t keymap_key_layers[MATRIX_ROWS][MATRIX_COLS];
+static bool keymap_ram_ready = false;
+
+void keymap_ram_init(void) {
+    for (uint8_t layer = 0; layer < KEYMAP_LAYERS; layer++) {
+        for (uint8_t row = 0; row < MATRIX_ROWS; row++) {
+            for (uint8_t col = 0; col < MATRIX_COLS; col++) {
+                uint16_t keycode = pgm_read_word(&keymaps[layer][row][col]);
+                keymap_ram[layer][row][col] = keycode;
+                if (keycode != KC_TRNS) {
+                    keymap_key_layers[row][col] |= (layer_state_t)1 << layer;
+                }
+            }
+        }
+    }
+    keymap_ram_ready = true;
+}
+
+HOT_PATH uint16_t keymap_ram_keycode(uint8_t layer, uint8_t row, uint8_t col) {
+    if (!keymap_ram_ready) {
+        return keycode_at_keymap_location(layer, row, col);
+    }
+    return layer < KEYMAP_LAYERS ? keymap_ram[layer][row][col] : KC_TRNS;
+}
+
+// Resolved-keycode cache: the layer and keycode a press at each position
+// resolves to under the current layer state. layer_state_set_user() and
+// default_layer_state_set_user() refresh only the positions that are opaque
+// on a layer whose bit changed. Releases still look up the source layer QMK
+// recorded at press time, so a key held across a layer change releases what
+// it pressed.
+static uint8_t resolved_layers[MATRIX_ROWS][MATRIX_COLS];
+static uint16_t resolved_keycodes[MATRIX_ROWS][MATRIX_COLS];
+static layer_state_t resolved_state = 0;
+static bool resolved_ready = false;
+
+void resolved_keymap_update(layer_state_t state) {
+    if (!keymap_ram_ready) return;
+
+    layer_state_t changed = state ^ resolved_state;
+    for (uint8_t row = 0; row < MATRIX_ROWS; row++) {
+        for (uint8_t col = 0; col < MATRIX_COLS; col++) {
+            if (resolved_ready && !(keymap_key_layers[row][col] & changed)) continue;
+
+            layer_state_t layers = state & keymap_key_layers[row][col];
+            uint8_t layer = layers ? 31 - __builtin_clz(layers) : 0;
+            resolved_layers[row][col] = layer;
+            resolved_keycodes[row][col] = keymap_ram_keycode(layer, row, col);
+        }
+    }
+    resolved_state = state;
+    resolved_ready = true;
+}
+
+// QMK asks for the keycode of each active layer from the top down until one
+// isn't transparent, and for the source layer on release; the layer a press
+// resolves to is answered from the cache
+HOT_PATH uint16_t keymap_key_to_keycode(uint8_t layer, keypos_t key) {
+    if (key.row >= MATRIX_ROWS || key.col >= MATRIX_COLS) {
+        return KC_NO;
+    }
+    if (resolved_ready && resolved_layers[key.row][key.col] == layer) {
+        return resolved_keycodes[key.row][key.col];
+    }
+    return keymap_ram_keycode(layer, key.row, key.col);
+}
+
+// Layer a press at key resolves to right now
+HOT_PATH uint8_t resolved_layer(keypos_t key) {
+    if (!resolved_ready) {
+        return layer_switch_get_layer(key);
+    }
+    return resolved_layers[key.row][key.col];
+}
+
+// Keycode a press at key resolves to right now
+HOT_PATH uint16_t resolved_keycode(keypos_t key) {
+    if (!resolved_ready) {
+        return keymap_key_to_keycode(layer_switch_get_layer(key), key);
+    }
+    return resolved_keycodes[key.row][key.col];
+}
+
+void combo_init(void);
+
+void keyboard_pre_init_user(void) {
+    keymap_ram_init();
+    resolved_keymap_update(layer_state | default_layer_state);
+    combo_init();
+}
+
+// --------
+// Debounce
+// --------
+
+// DEBOUNCE_TYPE = custom in rules.mk. Per-key debounce with one countdown per
+// key: on typing layers a key changes state only after DEBOUNCE ms without
+// further chatter (symmetric defer). While _GAMING is active presses are
+// reported on the first scan that sees them and only releases are deferred,
+// so a press costs no debounce delay. A key reported eagerly is locked for
+// DEBOUNCE ms, which keeps press chatter from turning into a second press.
+// The mode is switched from layer_state_set_user(), never per scan.
+static uint8_t debounce_timers[MATRIX_ROWS][MATRIX_COLS]; // ms left, 0 = settled
+static fast_timer_t debounce_last;
+static bool debounce_pending = false;
+static bool debounce_eager_press = false;
+
+void debounce_init(uint8_t num_rows) {
+    memset(debounce_timers, 0, sizeof(debounce_timers));
+    debounce_last = timer_read_fast();
+}
+
+void debounce_free(void) {}
+
+HOT_PATH bool debounce(matrix_row_t raw[], matrix_row_t cooked[], uint8_t num_rows, bool changed) {
+    bool cooked_changed = false;
+    fast_timer_t now = timer_read_fast();
+
+    if (debounce_pending) {
+        uint8_t elapsed = MIN(TIMER_DIFF_FAST(now, debounce_last), UINT8_MAX);
+        debounce_pending = false;
+        for (uint8_t row = 0; row < num_rows; row++) {
+            for (uint8_t col = 0; col < MATRIX_COLS; col++) {
+                uint8_t *timer = &debounce_timers[row][col];
+                if (*timer == 0) {
+                    continue;
+                }
+                if (*timer > elapsed) {
+                    *timer -= elapsed;
+                    debounce_pending = true;
+                    continue;
+                }
+                *timer = 0;
+                matrix_row_t mask = MATRIX_ROW_SHIFTER << col;
+                matrix_row_t next = (cooked[row] & ~mask) | (raw[row] & mask);
+                cooked_changed |= next != cooked[row];
+                cooked[row] = next;
+            }
+        }
+    }
+    debounce_last = now;
+
+    if (changed) {
+        for (uint8_t row = 0; row < num_rows; row++) {
+            matrix_row_t delta = raw[row] ^ cooked[row];
+            for (uint8_t col = 0; delta; col++, delta >>= 1) {
+                if (!(delta & 1)) {
+                    continue;
+                }
+                matrix_row_t mask = MATRIX_ROW_SHIFTER << col;
+                if (debounce_eager_press && (raw[row] & mask) && debounce_timers[row][col] == 0) {
+                    cooked[row] |= mask;
+                    cooked_changed = true;
+                }
+                debounce_timers[row][col] = tuning.debounce;
+                debounce_pending = true;
+            }
+        }
+    }
+    return cooked_changed;
+}
+
+// ---------------------
+// Adaptive tapping term
+// ---------------------
+
+// ADAPTIVE_TAPPING_TERM in config.h. Every tap dance learns its own tapping
+// term from how it is actually typed: an exponentially weighted mean and mean
+// deviation of the press-to-release time of its taps and of the press-to-press
+// interval between the taps of one dance, the two spans the tap dance timer
+// measures. The term sits ADAPTIVE_TERM_SPREAD deviations above the slower of
+// the two, clamped to TAPPING_TERM_MIN..TAPPING_TERM_MAX. Only taps are
+// learned: a press whose dance finished before the key came up (timed out, or
+// interrupted by a key rolled inside it, like a modifier held for one key) is
+// a hold and left out, and so is a press that started a new dance. Otherwise
+// short deliberate holds pull the term up into the typist's hold times and
+// turn those holds into taps. Until ADAPTIVE_TERM_WARMUP taps have been seen
+// the global tapping term applies.
+#ifdef ADAPTIVE_TAPPING_TERM
+#    define ADAPTIVE_TERM_MAGIC 0x5442 // "AT", bump when td_timing_t changes
+
+typedef struct {
+    uint16_t mean; // 1/4 ms, 0 = no samples yet
+    uint16_t dev;  // mean absolute deviation, 1/4 ms
+} __attribute__((packed)) ewma_t;
+
+typedef struct {
+    ewma_t hold;
+    ewma_t interval;
+    uint8_t samples; // saturates at UINT8_MAX
+} __attribute__((packed)) td_timing_t;
+
+typedef struct {
+    uint16_t magic;
+    td_timing_t timing[TD_COUNT];
+} __attribute__((packed)) td_timing_store_t;
+
+_Static_assert(sizeof(td_timing_store_t) <= ADAPTIVE_TERM_STORE_SIZE, "ADAPTIVE_TERM_STORE_SIZE too small");
+
+static td_timing_store_t td_timing;
+static uint16_t td_terms[TD_COUNT];
+static uint16_t td_pressed_at[TD_COUNT];
+static bool td_timing_dirty = false;
+static uint32_t td_timing_saved = 0;
+
+HOT_PATH void ewma_add(ewma_t *ewma, uint16_t sample_ms) {
+    int16_t sample = sample_ms << 2;
+    if (ewma->mean == 0) {
+        ewma->mean = sample;
+        ewma->dev = sample / 4;
+        return;
+    }
+    int16_t error = sample - (int16_t)ewma->mean;
+    ewma->mean += error / 8;
+    ewma->dev += ((error < 0 ? -error : error) - (int16_t)ewma->dev) / 8;
+}
+
+HOT_PATH uint16_t adaptive_term_compute(const td_timing_t *timing) {
+    if (timing->samples < ADAPTIVE_TERM_WARMUP) {
+        return 0; // not learned yet
+    }
+    uint16_t hold = timing->hold.mean + ADAPTIVE_TERM_SPREAD * timing->hold.dev;
+    // A dance never tapped twice yet keeps the global term for its second tap:
+    // below it, slower second taps would never join a dance and be learned
+    uint16_t interval = timing->interval.mean ? timing->interval.mean + ADAPTIVE_TERM_SPREAD * timing->interval.dev : tuning.tapping_term << 2;
+    uint16_t term = MAX(hold, interval) >> 2;
+    return MIN(MAX(term, TAPPING_TERM_MIN), TAPPING_TERM_MAX);
+}
+
+void adaptive_term_load(void) {
+    eeconfig_read_user_datablock(&td_timing, ADAPTIVE_TERM_STORE_OFFSET, sizeof(td_timing));
+    if (td_timing.magic != ADAPTIVE_TERM_MAGIC) {
+        memset(&td_timing, 0, sizeof(td_timing));
+        td_timing.magic = ADAPTIVE_TERM_MAGIC;
+    }
+    for (uint8_t i = 0; i < TD_COUNT; i++) {
+        td_terms[i] = adaptive_term_compute(&td_timing.timing[i]);
+    }
+}
+
+// Called for every tap-dance key event from process_record_user(). tap is set
+// for a press that adds a tap to a running dance, and for a release that ends
+// a press the dance still counts as a tap.
+HOT_PATH void adaptive_term_record(uint16_t keycode, keyrecord_t *record, bool tap) {
+    uint8_t index = QK_TAP_DANCE_GET_INDEX(keycode);
+    if (index >= TD_COUNT) {
+        return;
+    }
+    td_timing_t *timing = &td_timing.timing[index];
+    uint16_t now = record->event.time;
+    uint16_t elapsed = TIMER_DIFF_16(now, td_pressed_at[index]);
+
+    if (record->event.pressed) {
+        td_pressed_at[index] = now;
+        if (!tap) {
+            return;
+        }
+        ewma_add(&timing->interval, elapsed);
+    } else if (tap && elapsed < TAPPING_TERM_MAX) {
+        ewma_add(&timing->hold, elapsed);
+        if (timing->samples < UINT8_MAX) {
+            timing->samples++;
+        }
+    } else {
+        return;
+    }
+    td_terms[index] = adaptive_term_compute(timing);
+    td_timing_dirty = true;
+}
+
+// Learned timings are written at most every ADAPTIVE_TERM_SAVE_INTERVAL ms,
+// and only once the keyboard has been idle for a moment so the flash write
+// never stalls typing
+void adaptive_term_task(void) {
+    if (td_timing_dirty && timer_elapsed32(td_timing_saved) >= ADAPTIVE_TERM_SAVE_INTERVAL && last_input_activity_elapsed() >= ADAPTIVE_TERM_SAVE_IDLE) {
+        eeconfig_update_user_datablock(&td_timing, ADAPTIVE_TERM_STORE_OFFSET, sizeof(td_timing));
+        td_timing_dirty = false;
+        td_timing_saved = timer_read32();
+    }
+}
+
+#endif
+
+HOT_PATH uint16_t get_tapping_term(uint16_t keycode, keyrecord_t *record) {
+#ifdef ADAPTIVE_TAPPING_TERM
+    if (IS_QK_TAP_DANCE(keycode) && QK_TAP_DANCE_GET_INDEX(keycode) < TD_COUNT && td_terms[QK_TAP_DANCE_GET_INDEX(keycode)]) {
+        return td_terms[QK_TAP_DANCE_GET_INDEX(keycode)];
+    }
+#endif
+    return tuning.tapping_term;
+}
+
 // --------------------------
 // RGB Lighting Configuration
 // --------------------------
@@ -868,158 +1249,25 @@ LED index mapping:
 
 */
 
-const rgblight_segment_t PROGMEM BASE_LIGHT_LAYER[] = RGBLIGHT_LAYER_SEGMENTS(
-    // left side - Base purple (Star Platinum Purple: #9300ff = HSV(194,255,255))
-    {0, 6, HSV_BASE_PURPLE},
-    {6, 6, HSV_BASE_PURPLE},
-    {12, 6, HSV_BASE_PURPLE},
-    {18, 6, HSV_BASE_PURPLE},
-    {24, 1, HSV_BASE_PURPLE},
-    {25, 1, HSV_BASE_PURPLE},
-    {26, 1, HSV_BASE_PURPLE},
-    {27, 1, HSV_BASE_PURPLE},
-    {28, 3, HSV_BASE_PURPLE}, // underglow
-    {31, 3, HSV_BASE_PURPLE}, // underglow
-    // right side
-    {34, 6, HSV_BASE_PURPLE},
-    {40, 6, HSV_BASE_PURPLE},
-    {46, 6, HSV_BASE_PURPLE},
-    {52, 6, HSV_BASE_PURPLE},
-    {58, 1, HSV_BASE_PURPLE},
-    {59, 1, HSV_BASE_PURPLE},
-    {60, 1, HSV_BASE_PURPLE},
-    {61, 1, HSV_BASE_PURPLE},
-    {62, 3, HSV_BASE_PURPLE}, // underglow
-    {65, 3, HSV_BASE_PURPLE} // underglow
-);
-
-const rgblight_segment_t PROGMEM FUNCTION_LIGHT_LAYER[] = RGBLIGHT_LAYER_SEGMENTS(
-    // left side - Function green (Squeeze Toy Alien: #0fee00 = HSV(82,255,238))
-    {0, 6, HSV_FUNCTION_GREEN},
-    {6, 6, HSV_FUNCTION_GREEN},
-    {12, 6, HSV_FUNCTION_GREEN},
-    {18, 6, HSV_FUNCTION_GREEN},
-    {24, 4, HSV_FUNCTION_GREEN},
-    {28, 3, HSV_FUNCTION_GREEN}, // underglow
-    {31, 3, HSV_FUNCTION_GREEN}, // underglow
-    // right side
-    {34, 6, HSV_FUNCTION_GREEN},
-    {40, 6, HSV_FUNCTION_GREEN},
-    {46, 6, HSV_FUNCTION_GREEN},
-    {52, 6, HSV_FUNCTION_GREEN},
-    {58, 1, HSV_FUNCTION_GREEN},
-    {59, 1, HSV_FUNCTION_GREEN},
-    {60, 2, HSV_FUNCTION_GREEN},
-    {62, 3, HSV_FUNCTION_GREEN}, // underglow
-    {65, 3, HSV_FUNCTION_GREEN} // underglow
-);
-
-const rgblight_segment_t PROGMEM NUMBERS_LIGHT_LAYER[] = RGBLIGHT_LAYER_SEGMENTS(
-    // left side - Numbers blue (Blue Pencil: #2000ff = HSV(175,255,255))
-    {0, 6, HSV_NUMBERS_BLUE},
-    {6, 6, HSV_NUMBERS_BLUE},
-    {12, 6, HSV_NUMBERS_BLUE},
-    {18, 6, HSV_NUMBERS_BLUE},
-    {24, 4, HSV_NUMBERS_BLUE},
-    {28, 3, HSV_NUMBERS_BLUE}, // underglow
-    {31, 3, HSV_NUMBERS_BLUE}, // underglow
-    // right side
-    {34, 6, HSV_NUMBERS_BLUE},
-    {40, 6, HSV_NUMBERS_BLUE},
-    {46, 6, HSV_NUMBERS_BLUE},
-    {52, 6, HSV_NUMBERS_BLUE},
-    {58, 2, HSV_NUMBERS_BLUE},
-    {60, 1, HSV_NUMBERS_BLUE},
-    {61, 1, HSV_NUMBERS_BLUE},
-    {62, 3, HSV_NUMBERS_BLUE}, // underglow
-    {65, 3, HSV_NUMBERS_BLUE} // underglow
-);
-
-const rgblight_segment_t PROGMEM SYMBOLS_LIGHT_LAYER[] = RGBLIGHT_LAYER_SEGMENTS(
-    // left side - Symbols red (Red: #ff0000 = HSV(0,255,255))
-    {0, 6, HSV_SYMBOLS_RED},
-    {6, 6, HSV_SYMBOLS_RED},
-    {12, 6, HSV_SYMBOLS_RED},
-    {18, 6, HSV_SYMBOLS_RED},
-    {24, 4, HSV_SYMBOLS_RED},
-    {28, 3, HSV_SYMBOLS_RED}, // underglow
-    {31, 3, HSV_SYMBOLS_RED}, // underglow
-    // right side
-    {34, 6, HSV_SYMBOLS_RED},
-    {40, 6, HSV_SYMBOLS_RED},
-    {46, 6, HSV_SYMBOLS_RED},
-    {52, 6, HSV_SYMBOLS_RED},
-    {58, 4, HSV_SYMBOLS_RED},
-    {60, 2, HSV_SYMBOLS_RED},
-    {61, 2, HSV_SYMBOLS_RED},
-    {62, 3, HSV_SYMBOLS_RED}, // underglow
-    {65, 3, HSV_SYMBOLS_RED} // underglow
-);
-
-const rgblight_segment_t PROGMEM SYSTEM_LIGHT_LAYER[] = RGBLIGHT_LAYER_SEGMENTS(
-    // left side - System yellow (Busy Bee: #f6ff00 = HSV(43,255,255))
-    {0, 6, HSV_SYSTEM_YELLOW},
-    {6, 6, HSV_SYSTEM_YELLOW},
-    {12, 6, HSV_SYSTEM_YELLOW},
-    {18, 6, HSV_SYSTEM_YELLOW},
-    {24, 2, HSV_SYSTEM_YELLOW},
-    {26, 1, HSV_SYSTEM_YELLOW},
-    {27, 1, HSV_SYSTEM_YELLOW},
-    {28, 3, HSV_SYSTEM_YELLOW}, // underglow
-    {31, 3, HSV_SYSTEM_YELLOW}, // underglow
-    // right side
-    {34, 6, HSV_SYSTEM_YELLOW},
-    {40, 6, HSV_SYSTEM_YELLOW},
-    {46, 6, HSV_SYSTEM_YELLOW},
-    {52, 6, HSV_SYSTEM_YELLOW},
-    {58, 4, HSV_SYSTEM_YELLOW},
-    {62, 3, HSV_SYSTEM_YELLOW}, // underglow
-    {65, 3, HSV_SYSTEM_YELLOW} // underglow
-);
-
-const rgblight_segment_t PROGMEM GAMING_LIGHT_LAYER[] = RGBLIGHT_LAYER_SEGMENTS(
-    // left side - Gaming turquoise (Turquoise Blue: #00fff4 = HSV(125,255,255))
-    {0, 6, HSV_GAMING_TURQUOISE},
-    {6, 6, HSV_GAMING_TURQUOISE},
-    {12, 6, HSV_GAMING_TURQUOISE},
-    {18, 6, HSV_GAMING_TURQUOISE},
-    {24, 2, HSV_GAMING_TURQUOISE},
-    {26, 1, HSV_GAMING_TURQUOISE},
-    {27, 1, HSV_GAMING_TURQUOISE},
-    {28, 3, HSV_GAMING_TURQUOISE}, // underglow
-    {31, 3, HSV_GAMING_TURQUOISE}, // underglow
-    // right side
-    {34, 6, HSV_GAMING_TURQUOISE},
-    {40, 6, HSV_GAMING_TURQUOISE},
-    {46, 6, HSV_GAMING_TURQUOISE},
-    {52, 6, HSV_GAMING_TURQUOISE},
-    {58, 2, HSV_GAMING_TURQUOISE},
-    {60, 1, HSV_GAMING_TURQUOISE},
-    {61, 1, HSV_GAMING_TURQUOISE},
-    {62, 3, HSV_GAMING_TURQUOISE}, // underglow
-    {65, 3, HSV_GAMING_TURQUOISE} // underglow
-);
-
-const rgblight_segment_t PROGMEM MACRO_LIGHT_LAYER[] = RGBLIGHT_LAYER_SEGMENTS(
-    // left side - Macro pink (Pink Panther: #ff008e = HSV(231,255,255))
-    {0, 6, HSV_MACRO_PINK},
-    {6, 6, HSV_MACRO_PINK},
-    {12, 6, HSV_MACRO_PINK},
-    {18, 6, HSV_MACRO_PINK},
-    {24, 2, HSV_MACRO_PINK},
-    {26, 1, HSV_MACRO_PINK},
-    {27, 1, HSV_MACRO_PINK},
-    {28, 3, HSV_MACRO_PINK}, // underglow
-    {31, 3, HSV_MACRO_PINK}, // underglow
-    // right side
-    {34, 6, HSV_MACRO_PINK},
-    {40, 6, HSV_MACRO_PINK},
-    {46, 6, HSV_MACRO_PINK},
-    {52, 6, HSV_MACRO_PINK},
-    {58, 4, HSV_MACRO_PINK},
-    {62, 3, HSV_MACRO_PINK}, // underglow
-    {65, 3, HSV_MACRO_PINK} // underglow
-);
+// Each layer lights the whole strip (keys and underglow, both halves) in the
+// layer colour, so its run-length segment list is a single run and the
+// renderer has one segment to walk per refresh. Layers that need per-key
+// colours can still list explicit segments with RGBLIGHT_LAYER_SEGMENTS.
+#define SOLID_LIGHT_LAYER(hsv) RGBLIGHT_LAYER_SEGMENTS({0, RGBLIGHT_LED_COUNT, hsv})
+
+const rgblight_segment_t PROGMEM BASE_LIGHT_LAYER[] = SOLID_LIGHT_LAYER(HSV_BASE_PURPLE);           // #9300ff
+const rgblight_segment_t PROGMEM FUNCTION_LIGHT_LAYER[] = SOLID_LIGHT_LAYER(HSV_FUNCTION_GREEN);    // #0fee00
+const rgblight_segment_t PROGMEM NUMBERS_LIGHT_LAYER[] = SOLID_LIGHT_LAYER(HSV_NUMBERS_BLUE);       // #2000ff
+const rgblight_segment_t PROGMEM SYMBOLS_LIGHT_LAYER[] = SOLID_LIGHT_LAYER(HSV_SYMBOLS_RED);        // #ff0000
+const rgblight_segment_t PROGMEM SYSTEM_LIGHT_LAYER[] = SOLID_LIGHT_LAYER(HSV_SYSTEM_YELLOW);       // #f6ff00
+const rgblight_segment_t PROGMEM GAMING_LIGHT_LAYER[] = SOLID_LIGHT_LAYER(HSV_GAMING_TURQUOISE);    // #00fff4
+const rgblight_segment_t PROGMEM MACRO_LIGHT_LAYER[] = SOLID_LIGHT_LAYER(HSV_MACRO_PINK);           // #ff008e
+
+// Indicator layers sit above the keymap layers and light the key that
+// toggles them on the _MACRO layer (caps: the left shift key)
+const rgblight_segment_t PROGMEM JIGGLER_LIGHT_LAYER[] = RGBLIGHT_LAYER_SEGMENTS({50, 1, HSV_GREEN});
+const rgblight_segment_t PROGMEM TURBO_LIGHT_LAYER[] = RGBLIGHT_LAYER_SEGMENTS({17, 1, HSV_BLUE});
+const rgblight_segment_t PROGMEM CAPS_LIGHT_LAYER[] = RGBLIGHT_LAYER_SEGMENTS({12, 1, HSV_WHITE});
 
 const rgblight_segment_t* const PROGMEM MY_LIGHT_LAYERS[] = RGBLIGHT_LAYERS_LIST(
     BASE_LIGHT_LAYER,
@@ -1028,87 +1276,1443 @@ const rgblight_segment_t* const PROGMEM MY_LIGHT_LAYERS[] = RGBLIGHT_LAYERS_LIST
     SYMBOLS_LIGHT_LAYER,
     SYSTEM_LIGHT_LAYER,
     GAMING_LIGHT_LAYER,
-    MACRO_LIGHT_LAYER
+    MACRO_LIGHT_LAYER,
+    JIGGLER_LIGHT_LAYER,
+    TURBO_LIGHT_LAYER,
+    CAPS_LIGHT_LAYER
 );
 
+// Light layers with a segment that covers the whole strip, read from the
+// tables above at boot. Such a layer hides every layer below it when on.
+static rgblight_layer_mask_t light_full_layers = 0;
+
+void lights_init(void) {
+    for (uint8_t layer = 0; layer < sizeof(MY_LIGHT_LAYERS) / sizeof(MY_LIGHT_LAYERS[0]); layer++) {
+        const rgblight_segment_t *segment_ptr = pgm_read_ptr(&MY_LIGHT_LAYERS[layer]);
+        if (!segment_ptr) break;
+
+        rgblight_segment_t segment;
+        memcpy_P(&segment, segment_ptr, sizeof(segment));
+        while (segment.index != RGBLIGHT_END_SEGMENT_INDEX) {
+            if (segment.index == 0 && segment.count >= RGBLIGHT_LED_COUNT) {
+                light_full_layers |= (rgblight_layer_mask_t)1 << layer;
+                break;
+            }
+            memcpy_P(&segment, ++segment_ptr, sizeof(segment));
+        }
+    }
+}
+
+void indicators_sync_slave(uint8_t in_buflen, const void *in_data, uint8_t out_buflen, void *out_data);
+void lights_post(rgblight_layer_mask_t mask, rgblight_layer_mask_t enabled);
+
 void keyboard_post_init_user(void) {
     rgblight_layers = MY_LIGHT_LAYERS;
+    lights_init();
+#ifdef ADAPTIVE_TAPPING_TERM
+    adaptive_term_load();
+#endif
+#ifdef HEATMAP_ENABLE
+    heatmap_load();
+#endif
+#ifdef TUNING_ENABLE
+    tuning_load();
+    transaction_register_rpc(RPC_ID_USER_TUNING, tuning_sync_slave);
+#endif
+#ifdef SPLIT_LOCAL_LIGHTS
+    transaction_register_rpc(RPC_ID_USER_INDICATORS, indicators_sync_slave);
+#endif
 }
 
 layer_state_t default_layer_state_set_user(layer_state_t state) {
-    rgblight_set_layer_state(_BASE, layer_state_cmp(state, _BASE));
+    lights_post((rgblight_layer_mask_t)1 << _BASE, (rgblight_layer_mask_t)layer_state_cmp(state, _BASE) << _BASE);
+    resolved_keymap_update(layer_state | state);
 
     return state;
 }
 
+// Light layers _BASE..LAST_LAYER mirror the keymap layers of the same index
+#define KEYMAP_LIGHT_LAYERS ((rgblight_layer_mask_t)((1 << (LAST_LAYER + 1)) - 1))
+
+// Sets every light layer in mask to its bit in enabled with a single LED
+// refresh and split sync. Each rgblight_set_layer_state() call re-renders the
+// strip and flags a split transfer, so all changed layers but one are written
+// straight into the rgblight status and the stock setter applies the last.
+void light_layers_update(rgblight_layer_mask_t mask, rgblight_layer_mask_t enabled) {
+    rgblight_layer_mask_t changed = (rgblight_status.enabled_layer_mask ^ enabled) & mask;
+    if (!changed) return;
+
+    uint8_t last = 31 - __builtin_clz(changed);
+    rgblight_layer_mask_t direct = changed & ~((rgblight_layer_mask_t)1 << last);
+    rgblight_status.enabled_layer_mask ^= direct;
+    rgblight_set_layer_state(last, enabled & ((rgblight_layer_mask_t)1 << last));
+}
+
+// Light render stage. Key handling never renders: layer and indicator changes
+// only update light_target and mark it dirty, and lights_render_task() in
+// housekeeping applies it with one light_layers_update(), after the scan and
+// key events of that loop iteration are done. Several changes in one
+// iteration cost one LED refresh.
+static rgblight_layer_mask_t light_target = 0;
+static bool light_dirty = false;
+
+// Sets the light layers in mask to their bits in enabled
+void lights_post(rgblight_layer_mask_t mask, rgblight_layer_mask_t enabled) {
+    light_target = (light_target & ~mask) | (enabled & mask);
+    light_dirty = true;
+}
+
+// Light layers that decide the pixels shown for a set of enabled ones: rgblight
+// draws layers in index order, so the highest enabled full-strip layer and
+// everything above it. Two sets with the same visible layers compose the same
+// frame.
+rgblight_layer_mask_t lights_visible(rgblight_layer_mask_t enabled) {
+    rgblight_layer_mask_t full = enabled & light_full_layers;
+    if (!full) return enabled;
+    return enabled & ~(((rgblight_layer_mask_t)1 << (31 - __builtin_clz(full))) - 1);
+}
+
+// light_target is the back buffer, the rgblight layer mask the front. A frame
+// is only sent to the LEDs and the other half when it changes a pixel;
+// otherwise the mask is updated without a refresh so the front stays current
+// (e.g. _BASE toggling underneath _FUNCTION).
+void lights_render_task(void) {
+    if (!light_dirty) return;
+    light_dirty = false;
+
+    rgblight_layer_mask_t frame = light_target;
+    if (frame == rgblight_status.enabled_layer_mask) return;
+
+    if (lights_visible(frame) == lights_visible(rgblight_status.enabled_layer_mask)) {
+        rgblight_status.enabled_layer_mask = frame;
+#ifdef RGBLIGHT_SPLIT
+        // The mirrored half still needs the new mask for the next real frame
+        rgblight_status.change_flags |= RGBLIGHT_STATUS_CHANGE_LAYERS;
+#endif
+        PERF_FRAME_SKIPPED();
+        return;
+    }
+    PERF_BEGIN(PERF_TAG_LIGHTS);
+    light_layers_update(~(rgblight_layer_mask_t)0, frame);
+    PERF_END(PERF_HOOK_LIGHTS);
+}
+
+void layer_lights_update(layer_state_t state) {
+    rgblight_layer_mask_t enabled = 0;
+    for (uint8_t layer = _BASE; layer <= LAST_LAYER; layer++) {
+        if (layer_state_cmp(state, layer)) {
+            enabled |= (rgblight_layer_mask_t)1 << layer;
+        }
+    }
+    lights_post(KEYMAP_LIGHT_LAYERS, enabled);
+}
+
 layer_state_t layer_state_set_user(layer_state_t state) {
-    rgblight_set_layer_state(_BASE, layer_state_cmp(state, _BASE));
-    rgblight_set_layer_state(_FUNCTION, layer_state_cmp(state, _FUNCTION));
-    rgblight_set_layer_state(_NUMBERS, layer_state_cmp(state, _NUMBERS));
-    rgblight_set_layer_state(_SYMBOLS, layer_state_cmp(state, _SYMBOLS));
-    rgblight_set_layer_state(_SYSTEM, layer_state_cmp(state, _SYSTEM));
-    rgblight_set_layer_state(_GAMING, layer_state_cmp(state, _GAMING));
-    rgblight_set_layer_state(_MACRO, layer_state_cmp(state, _MACRO));
+    resolved_keymap_update(state | default_layer_state);
+    layer_lights_update(state);
+    debounce_eager_press = layer_state_cmp(state, _GAMING);
     return state;
 }
 
-static int counter = 0;
-static int c1;
-static int c2;
+// The slave receives layer_state over the split link without a call to
+// layer_state_set_user(), so it applies layer changes from housekeeping
+void slave_layer_task(void) {
+    static layer_state_t applied = 0;
+    if (is_keyboard_master() || layer_state == applied) {
+        return;
+    }
+    applied = layer_state;
+    debounce_eager_press = layer_state_cmp(layer_state, _GAMING);
+#ifdef SPLIT_LOCAL_LIGHTS
+    layer_lights_update(layer_state);
+#endif
+}
+
+// Indicator flags, one bit per indicator light layer in the same order
+enum indicator_flags {
+    INDICATOR_JIGGLER = 1 << 0,
+    INDICATOR_TURBO   = 1 << 1,
+    INDICATOR_CAPS    = 1 << 2,
+};
+
+#define INDICATOR_LIGHT_BASE (LAST_LAYER + 1)
+#define INDICATOR_LIGHT_LAYERS ((rgblight_layer_mask_t)0x07 << INDICATOR_LIGHT_BASE)
+
+static uint8_t indicators = 0;
+
+void indicators_render(void) {
+    lights_post(INDICATOR_LIGHT_LAYERS, (rgblight_layer_mask_t)indicators << INDICATOR_LIGHT_BASE);
+}
+
+void indicators_set(uint8_t flag, bool on) {
+    indicators = on ? indicators | flag : indicators & ~flag;
+    indicators_render();
+}
+
+bool led_update_user(led_t led_state) {
+    indicators_set(INDICATOR_CAPS, led_state.caps_lock);
+    return true;
+}
+
+// Split light sync. By default RGBLIGHT_SPLIT mirrors the master's rgblight
+// state to the other half. With SPLIT_LOCAL_LIGHTS only the layer state
+// (SPLIT_LAYER_STATE_ENABLE) and a single indicator byte cross the link and
+// each half renders its own 34 LEDs from the shared light layer tables.
+#ifdef SPLIT_LOCAL_LIGHTS
+static uint8_t indicators_synced = 0xFF;
+static split_sync_t indicators_sync;
+
+void indicators_sync_slave(uint8_t in_buflen, const void *in_data, uint8_t out_buflen, void *out_data) {
+    indicators = *(const uint8_t *)in_data;
+    indicators_render();
+}
+
+void split_lights_task(void) {
+    if (is_keyboard_master() && indicators != indicators_synced && split_sync_send(&indicators_sync, RPC_ID_USER_INDICATORS, sizeof(indicators), &indicators)) {
+        indicators_synced = indicators;
+    }
+}
+#endif
+
+// Mouse jiggler: a deferred task nudges the pointer by JIGGLER_STEP and
+// straight back every JIGGLER_INTERVAL ms, so the cursor never drifts and the
+// scan loop is never blocked. The nudge is skipped while keys or mouse keys
+// have been used within JIGGLER_IDLE_TIMEOUT.
+static deferred_token jiggle_token = INVALID_DEFERRED_TOKEN;
+static bool jiggle_vertical = false;
+
+uint32_t jiggle_callback(uint32_t trigger_time, void *cb_arg) {
+    PERF_BEGIN(PERF_TAG_JIGGLER);
+    if (last_input_activity_elapsed() >= tuning.jiggler_idle) {
+        report_mouse_t report = mousekey_get_report();
+        report.x = report.y = report.v = report.h = 0;
+        if (jiggle_vertical) {
+            report.y = tuning.jiggler_step;
+            host_mouse_send(&report);
+            report.y = -tuning.jiggler_step;
+            host_mouse_send(&report);
+        } else {
+            report.x = tuning.jiggler_step;
+            host_mouse_send(&report);
+            report.x = -tuning.jiggler_step;
+            host_mouse_send(&report);
+        }
+        jiggle_vertical = !jiggle_vertical;
+    }
+    PERF_END(PERF_HOOK_DEFERRED);
+    return tuning.jiggler_interval;
+}
+
+void jiggle_start(void) {
+    if (jiggle_token == INVALID_DEFERRED_TOKEN) {
+        jiggle_token = defer_exec(tuning.jiggler_interval, jiggle_callback, NULL);
+    }
+}
+
+void jiggle_stop(void) {
+    cancel_deferred_exec(jiggle_token);
+    jiggle_token = INVALID_DEFERRED_TOKEN;
+}
+
+// Turbo rapid-fire for the GAMING layer. While TURBO is on, keys from
+// turbo_keycodes pressed on _GAMING are tracked and a deferred task releases
+// and re-presses all of them in one report every TURBO_INTERVAL ms until they
+// are let go.
+static uint8_t turbo_keys[TURBO_MAX_KEYS];
+static uint8_t turbo_key_count = 0;
+static bool turbo_down = true;
+static deferred_token turbo_token = INVALID_DEFERRED_TOKEN;
+
+// Keys that auto-fire, opt-in: the action keys around WASD. Movement,
+// modifiers, Space, Esc, Tab, Enter, the digits and every other key are
+// never turbo'd.
+static const uint8_t turbo_keycodes[] = {KC_Q, KC_E, KC_R, KC_F, KC_G, KC_Z, KC_X, KC_C, KC_V};
+
+HOT_PATH bool turbo_allowed(uint16_t keycode) {
+    for (uint8_t i = 0; i < sizeof(turbo_keycodes); i++) {
+        if (turbo_keycodes[i] == keycode) return true;
+    }
+    return false;
+}
+
+uint32_t turbo_callback(uint32_t trigger_time, void *cb_arg) {
+    if (turbo_key_count == 0) {
+        turbo_token = INVALID_DEFERRED_TOKEN;
+        return 0;
+    }
+
+    PERF_BEGIN(PERF_TAG_TURBO);
+    turbo_down = !turbo_down;
+    for (uint8_t i = 0; i < turbo_key_count; i++) {
+        if (turbo_down) {
+            add_key(turbo_keys[i]);
+        } else {
+            del_key(turbo_keys[i]);
+        }
+    }
+    send_keyboard_report();
+    PERF_END(PERF_HOOK_DEFERRED);
+    return tuning.turbo_interval;
+}
+
+HOT_PATH void turbo_track(uint16_t keycode, keyrecord_t *record) {
+    if (record->event.pressed) {
+        if (!IS_LAYER_ON(_GAMING) || !turbo_allowed(keycode) || turbo_key_count == TURBO_MAX_KEYS) return;
+
+        turbo_keys[turbo_key_count++] = keycode;
+        if (turbo_token == INVALID_DEFERRED_TOKEN) {
+            turbo_down = true;
+            turbo_token = defer_exec(tuning.turbo_interval, turbo_callback, NULL);
+        }
+        return;
+    }
+
+    for (uint8_t i = 0; i < turbo_key_count; i++) {
+        if (turbo_keys[i] == keycode) {
+            turbo_keys[i] = turbo_keys[--turbo_key_count];
+            return;
+        }
+    }
+}
+
+// Hands any keys still held back to normal processing in the pressed state
+void turbo_stop(void) {
+    cancel_deferred_exec(turbo_token);
+    turbo_token = INVALID_DEFERRED_TOKEN;
+    if (!turbo_down) {
+        for (uint8_t i = 0; i < turbo_key_count; i++) {
+            add_key(turbo_keys[i]);
+        }
+        send_keyboard_report();
+    }
+    turbo_key_count = 0;
+    turbo_down = true;
+}
+
+// Kinetic mouse keys. MS_UP/MS_DOWN/MS_LEFT/MS_RGHT are taken over from the
+// stock mousekey code and drive a deferred task that runs every
+// KINETIC_MOUSE_INTERVAL ms while any of them is held. Speed follows a
+// smoothstep curve from the stock starting speed to its top speed over the
+// stock ramp time, both derived from the MOUSEKEY_* settings, and distance
+// accumulates in 1/256 pixel steps so slow speeds move smoothly instead of in
+// whole-pixel jumps. A report is only sent when the pointer actually moves a
+// pixel; buttons and the wheel stay with the stock mousekey code.
+#ifdef KINETIC_MOUSE
+enum kinetic_directions {
+    KINETIC_UP    = 1 << 0,
+    KINETIC_DOWN  = 1 << 1,
+    KINETIC_LEFT  = 1 << 2,
+    KINETIC_RIGHT = 1 << 3,
+};
+
+static uint8_t kinetic_directions = 0;
+static uint32_t kinetic_started;
+static uint32_t kinetic_last;
+static int32_t kinetic_x, kinetic_y; // sub-pixel remainder, 1/256 px
+static deferred_token kinetic_token = INVALID_DEFERRED_TOKEN;
+
+// Current speed in px/s for a key held for held_ms
+uint32_t kinetic_speed(uint32_t held_ms) {
+    uint32_t f = MIN(held_ms * 256 / tuning.mouse_ramp, 256); // ramp progress, 1/256
+    uint32_t s = (f * f * (3 * 256 - 2 * f)) >> 16;            // smoothstep, 1/256
+    return tuning.mouse_start_speed + (((uint32_t)(tuning.mouse_max_speed - tuning.mouse_start_speed) * s) >> 8);
+}
+
+// Takes the whole pixels out of an accumulator, at most one report's worth
+int8_t kinetic_take(int32_t *accumulator) {
+    int32_t pixels = *accumulator / 256;
+    pixels = MIN(MAX(pixels, -127), 127);
+    *accumulator -= pixels * 256;
+    return pixels;
+}
+
+uint32_t kinetic_callback(uint32_t trigger_time, void *cb_arg) {
+    if (!kinetic_directions) {
+        kinetic_token = INVALID_DEFERRED_TOKEN;
+        return 0;
+    }
+
+    PERF_BEGIN(PERF_TAG_MOUSE);
+    uint32_t elapsed = trigger_time - kinetic_last;
+    kinetic_last = trigger_time;
+    int8_t dx = !!(kinetic_directions & KINETIC_RIGHT) - !!(kinetic_directions & KINETIC_LEFT);
+    int8_t dy = !!(kinetic_directions & KINETIC_DOWN) - !!(kinetic_directions & KINETIC_UP);
+
+    int32_t step = kinetic_speed(trigger_time - kinetic_started) * 256 * elapsed / 1000;
+    if (dx && dy) {
+        step = step * 181 / 256; // 1/sqrt(2), diagonals at the same speed
+    }
+    kinetic_x += dx * step;
+    kinetic_y += dy * step;
+
+    report_mouse_t report = mousekey_get_report();
+    report.v = report.h = 0;
+    report.x = kinetic_take(&kinetic_x);
+    report.y = kinetic_take(&kinetic_y);
+    if (report.x || report.y) {
+        host_mouse_send(&report);
+    }
+    PERF_END(PERF_HOOK_DEFERRED);
+    return KINETIC_MOUSE_INTERVAL;
+}
+
+void kinetic_mouse_record(uint16_t keycode, keyrecord_t *record) {
+    uint8_t direction = keycode == MS_UP ? KINETIC_UP : keycode == MS_DOWN ? KINETIC_DOWN : keycode == MS_LEFT ? KINETIC_LEFT : KINETIC_RIGHT;
+    if (!record->event.pressed) {
+        kinetic_directions &= ~direction;
+        return;
+    }
+
+    kinetic_directions |= direction;
+    if (kinetic_token == INVALID_DEFERRED_TOKEN) {
+        kinetic_started = kinetic_last = timer_read32();
+        kinetic_x = kinetic_y = 0;
+        kinetic_token = defer_exec(KINETIC_MOUSE_INTERVAL, kinetic_callback, NULL);
+    }
+}
+#endif
+
+// Dynamic macros. DM_REC1/DM_REC2/DM_PLY1/DM_PLY2 act on the two slots of the
+// current bank and MC_BANK steps through MACRO_BANKS banks. rules.mk leaves
+// DYNAMIC_MACRO_ENABLE off so these keycodes reach process_record_user().
+// A recording is the raw key events, encoded as they arrive into a slot-sized
+// buffer and written to the user EEPROM datablock (flash, via wear leveling)
+// in a single update when recording stops. Playback reads one event at a time
+// back out of the datablock and injects it at its matrix position with the
+// recorded timing, so the keymap resolves it exactly as it did while recording.
+// For that the slot also keeps the layer state recording started from:
+// playback switches to it first and back to the player's layers at the end.
+//
+// Events are usually two bytes:
+//   byte 0: bit 7 pressed, bit 6 delay follows, bits 0-5 row * MATRIX_COLS + col
+//   then, with bit 6 set, the time since the previous event in
+//   MACRO_TIME_QUANTUM ms units as a base-128 varint, low bits first
+#define MACRO_SLOTS (MACRO_BANKS * 2)
+#define MACRO_PRESSED 0x80
+#define MACRO_DELAY 0x40
+#define MACRO_POSITION 0x3F
+#define MACRO_DELAY_MAX 0x3FFF // quanta, fits a two-byte varint
+#define MACRO_EVENT_MAX 3
+#define MACRO_LAYERS 0x8000 // length flag: the layer state follows it, unset in older recordings
+
+_Static_assert(MATRIX_ROWS * MATRIX_COLS <= MACRO_POSITION + 1, "matrix too large for the macro event encoding");
+_Static_assert(MACRO_SLOTS * MACRO_SLOT_SIZE <= MACRO_STORE_SIZE, "MACRO_STORE_SIZE too small");
+
+typedef struct {
+    uint16_t length;      // bytes of events | MACRO_LAYERS, 0 = empty
+    layer_state_t layers; // layer state when recording started
+    uint8_t events[MACRO_SLOT_SIZE - sizeof(uint16_t) - sizeof(layer_state_t)];
+} __attribute__((packed)) macro_slot_t;
+
+static macro_slot_t macro_recording;
+static int8_t macro_recording_slot = -1;
+static uint16_t macro_last_event = 0;
+static uint8_t macro_held = 0;                     // recorded presses not yet released
+static matrix_row_t macro_recorded_down[MATRIX_ROWS];
+static uint8_t macro_bank = 0;
+
+static deferred_token macro_token = INVALID_DEFERRED_TOKEN;
+static uint32_t macro_play_base;
+static uint16_t macro_play_length;
+static uint16_t macro_play_position;
+static uint8_t macro_play_event;
+static layer_state_t macro_play_saved_layers;
+
+uint32_t macro_slot_offset(uint8_t slot) {
+    return MACRO_STORE_OFFSET + (uint32_t)slot * MACRO_SLOT_SIZE;
+}
+
+void macro_record_start(uint8_t slot) {
+    macro_recording_slot = slot;
+    macro_recording.length = 0;
+    macro_recording.layers = layer_state;
+    macro_held = 0;
+    memset(macro_recorded_down, 0, sizeof(macro_recorded_down));
+}
+
+void macro_record_stop(void) {
+    uint16_t length = macro_recording.length;
+    macro_recording.length |= MACRO_LAYERS;
+    eeconfig_update_user_datablock(&macro_recording, macro_slot_offset(macro_recording_slot), offsetof(macro_slot_t, events) + length);
+    macro_recording_slot = -1;
+}
+
+// A press is only recorded if the release of every recorded key still fits
+// after it, so a full slot never plays back a stuck key
+HOT_PATH void macro_record_event(keyrecord_t *record) {
+    keypos_t key = record->event.key;
+    if (key.row >= MATRIX_ROWS || key.col >= MATRIX_COLS) return;
+
+    matrix_row_t mask = MATRIX_ROW_SHIFTER << key.col;
+    if (!record->event.pressed && !(macro_recorded_down[key.row] & mask)) return;
+
+    uint8_t event[MACRO_EVENT_MAX];
+    uint8_t size = 1;
+    event[0] = (record->event.pressed ? MACRO_PRESSED : 0) | (key.row * MATRIX_COLS + key.col);
+    uint16_t quanta = MIN(TIMER_DIFF_16(record->event.time, macro_last_event) / MACRO_TIME_QUANTUM, MACRO_DELAY_MAX);
+    if (macro_recording.length > 0 && quanta > 0) {
+        event[0] |= MACRO_DELAY;
+        if (quanta > 0x7F) {
+            event[size++] = (quanta & 0x7F) | 0x80;
+            quanta >>= 7;
+        }
+        event[size++] = quanta;
+    }
+
+    uint16_t reserved = (macro_held + record->event.pressed) * MACRO_EVENT_MAX;
+    if (record->event.pressed && (uint32_t)macro_recording.length + size + reserved > sizeof(macro_recording.events)) return;
+
+    memcpy(&macro_recording.events[macro_recording.length], event, size);
+    macro_recording.length += size;
+    macro_last_event = record->event.time;
+    if (record->event.pressed) {
+        macro_recorded_down[key.row] |= mask;
+        macro_held++;
+    } else {
+        macro_recorded_down[key.row] &= ~mask;
+        macro_held--;
+    }
+}
+
+// Reads the event at the play position into macro_play_event and returns its
+// delay in ms, or -1 at the end of the macro
+int32_t macro_read_event(void) {
+    if (macro_play_position >= macro_play_length) return -1;
+
+    uint8_t buffer[MACRO_EVENT_MAX];
+    uint8_t count = MIN(MACRO_EVENT_MAX, macro_play_length - macro_play_position);
+    eeconfig_read_user_datablock(buffer, macro_play_base + macro_play_position, count);
+
+    uint8_t used = 1;
+    uint16_t quanta = 0;
+    if (buffer[0] & MACRO_DELAY) {
+        for (uint8_t shift = 0; used < count; shift += 7) {
+            uint8_t byte = buffer[used++];
+            quanta |= (uint16_t)(byte & 0x7F) << shift;
+            if (!(byte & 0x80)) break;
+        }
+    }
+    macro_play_event = buffer[0];
+    macro_play_position += used;
+    return (int32_t)quanta * MACRO_TIME_QUANTUM;
+}
+
+// Report packing. Events whose key is a plain or modifier keycode on the
+// current layer go straight into the keyboard report, and every event due at
+// the same time shares one report. A batch is sent early when the next event
+// would change what the host sees: the same key touched twice (so repeated
+// characters still get their own press and release) or a modifier changing
+// after a key press it must not apply to. Any other keycode is injected with
+// action_exec() through the full keymap, in a batch of its own. So is every
+// press after a tap dance press until another key press went that way: the
+// dance, or the tap-hold stage holding it, only hears of the next press
+// through action_exec(), and it has to go out before that press does.
+#define MACRO_SPEED_MAX 0
+
+static const uint8_t macro_speeds[] = {1, 2, MACRO_SPEED_MAX};
+static uint8_t macro_speed = 0;                                 // index into macro_speeds, MC_SPEED cycles
+static uint8_t macro_play_keycodes[MATRIX_ROWS * MATRIX_COLS]; // keycode held in the report per position
+static uint64_t macro_batch_touched = 0;                       // positions changed in the pending report
+static bool macro_batch_keys = false;                          // pending report presses a non-modifier
+static bool macro_dance_open = false;                          // last press through action_exec() was a tap dance
+
+void macro_batch_flush(void) {
+    if (macro_batch_touched) {
+        send_keyboard_report();
+        macro_batch_touched = 0;
+        macro_batch_keys = false;
+    }
+}
+
+// Plays one event, or returns false if it has to wait for the next report
+bool macro_batch_event(uint8_t event) {
+    uint8_t position = event & MACRO_POSITION;
+    bool pressed = event & MACRO_PRESSED;
+    keypos_t key = {.row = position / MATRIX_COLS, .col = position % MATRIX_COLS};
+    uint16_t keycode = pressed ? resolved_keycode(key) : macro_play_keycodes[position];
+    bool modifier = IS_MODIFIER_KEYCODE(keycode);
+
+    if ((!modifier && !IS_BASIC_KEYCODE(keycode)) || (pressed && macro_dance_open)) {
+        if (macro_batch_touched) return false;
+        macro_play_keycodes[position] = KC_NO;
+        if (pressed) {
+            macro_dance_open = IS_QK_TAP_DANCE(keycode);
+        }
+        action_exec(MAKE_KEYEVENT(key.row, key.col, pressed));
+        return true;
+    }
+    if ((macro_batch_touched & (1ULL << position)) || (modifier && macro_batch_keys)) return false;
+
+    if (modifier && pressed) {
+        add_mods(MOD_BIT(keycode));
+    } else if (modifier) {
+        del_mods(MOD_BIT(keycode));
+    } else if (pressed) {
+        add_key(keycode);
+        macro_batch_keys = true;
+    } else {
+        del_key(keycode);
+    }
+    macro_play_keycodes[position] = pressed ? keycode : KC_NO;
+    macro_batch_touched |= 1ULL << position;
+    return true;
+}
+
+// Builds one report from every event due now (every event that fits, at
+// maximum speed), sends it and returns the time to the next one
+uint32_t macro_play_callback(uint32_t trigger_time, void *cb_arg) {
+    uint8_t speed = macro_speeds[macro_speed];
+    int32_t delay = 1;
+    while (macro_batch_event(macro_play_event)) {
+        delay = macro_read_event();
+        if (delay < 0 || (delay > 0 && speed != MACRO_SPEED_MAX)) break;
+        delay = 1; // the event waiting for the next report goes out a frame later
+    }
+    macro_batch_flush();
+
+    if (delay < 0) {
+        macro_token = INVALID_DEFERRED_TOKEN;
+        layer_state_set(macro_play_saved_layers);
+        return 0;
+    }
+    return speed == MACRO_SPEED_MAX ? 1 : MAX(delay / speed, 1);
+}
+
+void macro_play(uint8_t slot) {
+    uint16_t length;
+    layer_state_t layers = layer_state;
+    eeconfig_read_user_datablock(&length, macro_slot_offset(slot), sizeof(length));
+    macro_play_base = macro_slot_offset(slot) + sizeof(uint16_t);
+    if (length & MACRO_LAYERS) {
+        eeconfig_read_user_datablock(&layers, macro_play_base, sizeof(layers));
+        macro_play_base += sizeof(layers);
+        length &= ~MACRO_LAYERS;
+    }
+    if (length == 0 || macro_play_base + length > macro_slot_offset(slot + 1)) return;
+
+    macro_play_length = length;
+    macro_play_position = 0;
+    macro_dance_open = false;
+    macro_read_event();
+    macro_token = defer_exec(1, macro_play_callback, NULL);
+    if (macro_token != INVALID_DEFERRED_TOKEN) {
+        macro_play_saved_layers = layer_state;
+        layer_state_set(layers);
+    }
+}
+
+HOT_PATH bool macro_process(uint16_t keycode, keyrecord_t *record) {
+    if (!IS_QK_DYNAMIC_MACRO(keycode) && keycode != MC_BANK && keycode != MC_SPEED) {
+        if (macro_recording_slot >= 0) {
+            macro_record_event(record);
+        }
+        return true;
+    }
+    if (!record->event.pressed || macro_token != INVALID_DEFERRED_TOKEN) return false;
+
+    if (macro_recording_slot >= 0) {
+        macro_record_stop();
+        return false;
+    }
+    switch (keycode) {
+        case DM_REC1: macro_record_start(macro_bank * 2); break;
+        case DM_REC2: macro_record_start(macro_bank * 2 + 1); break;
+        case DM_PLY1: macro_play(macro_bank * 2); break;
+        case DM_PLY2: macro_play(macro_bank * 2 + 1); break;
+        case MC_BANK: macro_bank = (macro_bank + 1) % MACRO_BANKS; break;
+        case MC_SPEED: macro_speed = (macro_speed + 1) % ARRAY_SIZE(macro_speeds); break;
+    }
+    return false;
+}
+
+// ------------------
+// Tap-hold decisions
+// ------------------
+
+// Last stage before the tapping layer. Replayed events re-enter here so they
+// get the same handling as live ones. They skip pre_process_record_quantum(),
+// so a replayed press interrupts the running tap dance itself, as a live one
+// would: otherwise it overtakes the dance's keycode (a buffered X ahead of a
+// Shift tap dance).
+void record_dispatch(keyrecord_t record) {
+    if (record.event.pressed) {
+        preprocess_tap_dance(resolved_keycode(record.event.key), &record);
+    }
+#ifndef NO_ACTION_TAPPING
+    action_tapping_process(record);
+#else
+    process_record(&record);
+#endif
+}
+
+// TAP_HOLD_DECISIONS in config.h. Dances with a policy below leave the
+// tap-dance engine and are decided from the keys rolled inside the hold
+// instead of from timing alone. Their descriptors keep their meaning: tap or
+// hold on a first press, double tap or double hold on a press that follows a
+// clean tap within the tapping term. A press is undecided, and later key
+// events wait in a buffer until
+//   - the key is released first: tap
+//   - TH_HOLD_ON_OTHER_KEY_PRESS and another key goes down: hold
+//   - TH_PERMISSIVE_HOLD and another key goes down and up: hold
+//   - the tapping term runs out: hold
+// and are then replayed in order. A third press after a double tap starts
+// over as a first press. Where the tap and hold keycodes of a first press are
+// the same, as on both thumb modifiers, any key pressed inside it makes it a
+// hold, and its tap is only sent once the tapping term after the release has
+// passed without a second press, or another key goes down. A double hold
+// therefore sends the double-hold keycode alone, never a stray tap of the
+// first (a lone GUI tap opens the Start menu). TH_EAGER registers such a
+// press on the press edge instead, for no delay on the first modifier at the
+// cost of that stray tap ahead of every double hold.
+#ifdef TAP_HOLD_DECISIONS
+enum tap_hold_policies {
+    TH_DECIDE                  = 1 << 0, // handled here rather than as a tap dance
+    TH_HOLD_ON_OTHER_KEY_PRESS = 1 << 1,
+    TH_PERMISSIVE_HOLD         = 1 << 2,
+    TH_EAGER                   = 1 << 3, // register a first press whose tap and hold match on the press edge
+};
+
+static const uint8_t tap_hold_policies[TD_COUNT] = {
+    [TD_LGUI_ALT]  = TH_DECIDE | TH_PERMISSIVE_HOLD,         // a GUI tap may roll into the next letter
+    [TD_RALT_CTRL] = TH_DECIDE | TH_HOLD_ON_OTHER_KEY_PRESS, // Ctrl shortcuts are pressed, not rolled
+};
+
+_Static_assert(TD_COUNT <= 32, "tap-hold dance sets are 32 bits");
+
+static uint64_t th_keys_down = 0;         // positions of held tap-hold keys
+static uint32_t th_down = 0;              // dances held
+static uint32_t th_interrupted = 0;       // held dances another key was pressed during
+static uint32_t th_report_on_release = 0; // registered on the press edge, outcome still open
+static keypos_t th_keys[TD_COUNT];
+static uint16_t th_registered[TD_COUNT];  // keycode to release with the key
+static uint16_t th_released_at[TD_COUNT]; // end of the last clean tap, 0 = none
+static uint8_t th_taps[TD_COUNT];
+static uint32_t th_tap_deferred = 0;      // taps held back for a possible second press
+
+// The undecided press, if any, and the events waiting for it
+static uint8_t th_pending = TD_COUNT;
+static uint16_t th_pending_since;
+static bool th_pending_plain;             // a first press whose tap and hold match
+static uint64_t th_pressed_inside = 0;
+static keyrecord_t th_buffer[TAP_HOLD_BUFFER];
+static uint8_t th_buffered = 0;
+
+bool tap_hold_process(keyrecord_t *record);
+
+HOT_PATH void tap_hold_outcome(uint8_t index, uint8_t step) {
+#ifdef HEATMAP_ENABLE
+    heatmap_tap_dance(index, step);
+#endif
+}
+
+// Sends a tap held back by tap_hold_decide(); a press after it is a first
+// press again
+HOT_PATH void tap_hold_flush(uint8_t index) {
+    th_tap_deferred &= ~((uint32_t)1 << index);
+    th_released_at[index] = 0;
+    tap_code16(pgm_read_word(&td_descriptors[index].tap));
+    PERF_TD_OUTPUT(index);
+    tap_hold_outcome(index, SINGLE_TAP);
+}
+
+// Sends the undecided press's tap or hold keycode
+HOT_PATH void tap_hold_decide(bool hold) {
+    uint8_t index = th_pending;
+    td_descriptor_t td;
+    memcpy_P(&td, &td_descriptors[index], sizeof(td));
+    th_pending = TD_COUNT;
+
+    bool first = th_taps[index] == 1;
+    uint16_t keycode = first ? (hold ? td.hold : td.tap) : (hold ? td.double_hold : td.double_tap);
+    th_registered[index] = KC_NO;
+    if (!hold && th_pending_plain) {
+        th_tap_deferred |= (uint32_t)1 << index;
+        return;
+    }
+    if (hold) {
+        register_code16(keycode);
+        th_registered[index] = keycode;
+    } else {
+        tap_code16(keycode);
+    }
+    PERF_TD_OUTPUT(index);
+    tap_hold_outcome(index, first ? (hold ? SINGLE_HOLD : SINGLE_TAP) : (hold ? DOUBLE_HOLD : DOUBLE_TAP));
+}
+
+// Replays the events that waited for a decision; one of them may start the
+// next undecided press, which buffers the rest again
+HOT_PATH void tap_hold_replay(void) {
+    keyrecord_t replay[TAP_HOLD_BUFFER];
+    uint8_t count = th_buffered;
+    memcpy(replay, th_buffer, count * sizeof(keyrecord_t));
+    th_buffered = 0;
+    for (uint8_t i = 0; i < count; i++) {
+        if (tap_hold_process(&replay[i])) {
+            record_dispatch(replay[i]);
+        }
+    }
+}
+
+HOT_PATH void tap_hold_resolve(bool hold) {
+    tap_hold_decide(hold);
+    tap_hold_replay();
+}
+
+// Holds an event back for the undecided press; a full buffer forces a hold
+// and the event goes on
+HOT_PATH bool tap_hold_buffer(keyrecord_t *record) {
+    if (th_buffered == TAP_HOLD_BUFFER) {
+        tap_hold_resolve(true);
+        return false;
+    }
+    th_buffer[th_buffered++] = *record;
+    return true;
+}
+
+HOT_PATH void tap_hold_task(void) {
+    if (th_pending != TD_COUNT && timer_elapsed(th_pending_since) >= get_tapping_term(TD(th_pending), NULL)) {
+        tap_hold_resolve(true);
+    }
+    for (uint8_t index = 0; th_tap_deferred >> index; index++) {
+        if ((th_tap_deferred & ((uint32_t)1 << index)) && timer_elapsed(th_released_at[index]) >= get_tapping_term(TD(index), NULL)) {
+            tap_hold_flush(index);
+        }
+    }
+}
+
+HOT_PATH void tap_hold_release(uint8_t index, keyrecord_t *record) {
+    th_keys_down &= ~((uint64_t)1 << (th_keys[index].row * MATRIX_COLS + th_keys[index].col));
+    th_down &= ~((uint32_t)1 << index);
+    bool clean = !(th_interrupted & ((uint32_t)1 << index)) && th_taps[index] == 1;
+
+    if (th_registered[index] != KC_NO) {
+        unregister_code16(th_registered[index]);
+        th_registered[index] = KC_NO;
+        clean = clean && (th_report_on_release & ((uint32_t)1 << index));
+    }
+    if (th_report_on_release & ((uint32_t)1 << index)) {
+        th_report_on_release &= ~((uint32_t)1 << index);
+        bool tap = !(th_interrupted & ((uint32_t)1 << index));
+        tap_hold_outcome(index, th_taps[index] == 1 ? (tap ? SINGLE_TAP : SINGLE_HOLD) : (tap ? DOUBLE_TAP : DOUBLE_HOLD));
+    }
+    th_released_at[index] = clean ? record->event.time | 1 : 0;
+}
+
+HOT_PATH void tap_hold_press(uint8_t index, uint16_t keycode, keyrecord_t *record) {
+    uint32_t dance = (uint32_t)1 << index;
+    th_keys_down |= (uint64_t)1 << (record->event.key.row * MATRIX_COLS + record->event.key.col);
+    th_keys[index] = record->event.key;
+    th_down |= dance;
+    th_interrupted &= ~dance;
+
+    bool again = th_released_at[index] && TIMER_DIFF_16(record->event.time, th_released_at[index]) < get_tapping_term(keycode, record);
+    th_taps[index] = again ? 2 : 1;
+    th_released_at[index] = 0;
+    PERF_TD_PRESS(index);
+
+    td_descriptor_t td;
+    memcpy_P(&td, &td_descriptors[index], sizeof(td));
+    uint16_t tap = again ? td.double_tap : td.tap;
+    uint16_t hold = again ? td.double_hold : td.hold;
+    if (tap == hold && (tap_hold_policies[index] & TH_EAGER)) {
+        register_code16(hold);
+        th_registered[index] = hold;
+        th_report_on_release |= dance;
+        PERF_TD_OUTPUT(index);
+        return;
+    }
+    th_pending = index;
+    th_pending_since = record->event.time;
+    th_pending_plain = tap == hold && !again;
+    th_pressed_inside = 0;
+}
+
+// Bookkeeping shared by every event of a tap-hold key, which never reaches
+// process_record_user(). tap is as for adaptive_term_record().
+HOT_PATH bool tap_hold_own_event(uint8_t index, keyrecord_t *record, bool tap) {
+#ifdef HEATMAP_ENABLE
+    if (record->event.pressed) {
+        heatmap_press(resolved_layer(record->event.key), record->event.key);
+    }
+#endif
+#ifdef ADAPTIVE_TAPPING_TERM
+    adaptive_term_record(TD(index), record, tap);
+#endif
+    if (macro_recording_slot >= 0) {
+        macro_record_event(record);
+    }
+    return false;
+}
+
+HOT_PATH uint8_t tap_hold_index(keyrecord_t *record) {
+    if (!record->event.pressed) {
+        for (uint8_t index = 0; index < TD_COUNT; index++) {
+            if ((th_down & ((uint32_t)1 << index)) && KEYEQ(th_keys[index], record->event.key)) {
+                return index;
+            }
+        }
+        return TD_COUNT;
+    }
+    uint16_t keycode = resolved_keycode(record->event.key);
+    if (IS_QK_TAP_DANCE(keycode) && QK_TAP_DANCE_GET_INDEX(keycode) < TD_COUNT && tap_hold_policies[QK_TAP_DANCE_GET_INDEX(keycode)]) {
+        return QK_TAP_DANCE_GET_INDEX(keycode);
+    }
+    return TD_COUNT;
+}
+
+// Returns true if the event should go on to the tapping layer now
+HOT_PATH bool tap_hold_process(keyrecord_t *record) {
+    keypos_t key = record->event.key;
+    if (key.row >= MATRIX_ROWS || key.col >= MATRIX_COLS) {
+        return true;
+    }
+    uint64_t bit = (uint64_t)1 << (key.row * MATRIX_COLS + key.col);
+
+    // A held-back tap goes out ahead of any press but a second press of its
+    // own key, which turns it into a double tap or hold. Like an interrupted
+    // tap dance, every other dance starts over with its next press.
+    if (record->event.pressed) {
+        uint8_t index = tap_hold_index(record);
+        for (uint8_t deferred = 0; th_tap_deferred >> deferred; deferred++) {
+            if (!(th_tap_deferred & ((uint32_t)1 << deferred))) continue;
+            if (deferred == index && TIMER_DIFF_16(record->event.time, th_released_at[deferred]) < get_tapping_term(TD(deferred), record)) {
+                th_tap_deferred &= ~((uint32_t)1 << deferred);
+            } else {
+                tap_hold_flush(deferred);
+            }
+        }
+        for (uint8_t other = 0; other < TD_COUNT; other++) {
+            if (other != index) {
+                th_released_at[other] = 0;
+            }
+        }
+    }
+
+    if (th_pending != TD_COUNT) {
+        uint8_t pending = th_pending;
+        uint8_t policy = tap_hold_policies[pending];
+        if (!record->event.pressed && KEYEQ(key, th_keys[pending])) {
+            tap_hold_decide(false);
+            tap_hold_release(pending, record);
+            tap_hold_replay();
+            return tap_hold_own_event(pending, record, true);
+        }
+        if (record->event.pressed) {
+            if ((policy & TH_HOLD_ON_OTHER_KEY_PRESS) || th_pending_plain) {
+                tap_hold_resolve(true);
+            } else if (tap_hold_buffer(record)) {
+                th_interrupted |= th_down;
+                th_pressed_inside |= bit;
+                return false;
+            }
+        } else if ((th_pressed_inside & bit) && (policy & TH_PERMISSIVE_HOLD)) {
+            tap_hold_resolve(true);
+        } else if (th_buffered && tap_hold_buffer(record)) {
+            return false;
+        }
+    }
+
+    if (record->event.pressed) {
+        th_interrupted |= th_down;
+    }
+    if (!record->event.pressed && !(th_keys_down & bit)) {
+        return true;
+    }
+    uint8_t index = tap_hold_index(record);
+    if (index == TD_COUNT) {
+        return true;
+    }
+    if (record->event.pressed) {
+        tap_hold_press(index, TD(index), record);
+    } else {
+        tap_hold_release(index, record);
+    }
+    // A second press joins the dance; a decided press released without
+    // anything rolled inside it was a tap
+    return tap_hold_own_event(index, record, record->event.pressed ? th_taps[index] == 2 : th_released_at[index] != 0);
+}
+
+// Runs an event through this stage and, unless it is held back or consumed,
+// on to the tapping layer
+HOT_PATH void tap_hold_dispatch(keyrecord_t record) {
+    if (tap_hold_process(&record)) {
+        record_dispatch(record);
+    }
+}
+
+// True if an event passed on now is also processed now, not buffered
+HOT_PATH bool tap_hold_idle(void) {
+    return th_pending == TD_COUNT;
+}
+#else
+#    define tap_hold_process(record) true
+#    define tap_hold_task()
+#    define tap_hold_dispatch record_dispatch
+#    define tap_hold_idle() true
+#endif
+
+// ------------
+// Layer combos
+// ------------
+
+// Layer moves as combos: a digit pressed together with the key below it moves
+// to that digit's layer in one short window, instead of a double-tap-and-hold
+// on the digit's tap dance. A combo is a set of matrix positions, one bit per
+// position (row * MATRIX_COLS + col), and starts with its first key, the
+// digit. At boot every subset of every combo that contains its first key is
+// entered into an open-addressed hash table keyed by that bitmask, together
+// with the combo it completes and the layers on which a larger combo still
+// contains it. Each key event then costs one lookup of the window's key set,
+// however many combos are defined.
+//
+// pre_process_record_user() runs ahead of tap dances. A press that could
+// start a combo on the current top layer opens a COMBO_TERM ms window; any
+// other press goes on untouched, so the letters below the digits never wait.
+// A speculative digit (TD_SPECULATIVE_DIGITS) goes out at once as well, since
+// a backspace can take it back. Only a first key that can't be taken back is
+// held until the window resolves: when its keys complete a combo that
+// nothing larger extends, a key outside the set is pressed, a key of the
+// window is released or COMBO_TERM ms pass. Either the combo fires, the
+// digits already sent are backspaced and the releases of the held keys are
+// dropped, or the held presses are replayed in order with their original
+// timestamps.
+typedef struct {
+    uint16_t keys[COMBO_MAX_KEYS]; // keycodes as bound on _BASE, unused ones KC_NO
+    uint8_t layer;                 // layer_move() target
+    uint8_t active;                // top layers the combo works on
+} layer_combo_t;
+
+#define COMBO_ON(layer) (1 << (layer))
+#define COMBO_TABLE_SIZE (1 << COMBO_TABLE_BITS)
+
+static const layer_combo_t layer_combos[] = {
+    {{TD(TD_1_FN), KC_Q}, _FUNCTION, COMBO_ON(_BASE)},
+    {{TD(TD_2_NUM), KC_W}, _NUMBERS, COMBO_ON(_BASE)},
+    {{TD(TD_3_SYS), KC_E}, _SYSTEM, COMBO_ON(_BASE)},
+    {{TD(TD_4_GAME), KC_R}, _GAMING, COMBO_ON(_BASE)},
+    {{TD(TD_5_MACRO), KC_T}, _MACRO, COMBO_ON(_BASE)},
+    {{TD(TD_6_BS), KC_Y}, _BASE, COMBO_ON(_FUNCTION) | COMBO_ON(_NUMBERS) | COMBO_ON(_SYMBOLS) | COMBO_ON(_SYSTEM) | COMBO_ON(_MACRO)},
+};
+
+#define LAYER_COMBO_COUNT (sizeof(layer_combos) / sizeof(layer_combos[0]))
+#ifndef COMBO_BENCH_COUNT
+#    define COMBO_BENCH_COUNT 0
+#endif
+
+_Static_assert(KEYMAP_LAYERS <= 8, "layer_combo_t.active is 8 bits");
+_Static_assert(MATRIX_ROWS * MATRIX_COLS <= 64, "combo position sets are 64 bits");
+_Static_assert(COMBO_TABLE_SIZE >= 2 * (LAYER_COMBO_COUNT * (1 << (COMBO_MAX_KEYS - 1)) + COMBO_BENCH_COUNT * 2), "COMBO_TABLE_BITS too small");
+
+typedef struct {
+    uint64_t keys;   // position set, 0 = free slot
+    uint8_t combo;   // 1 + index into layer_combos of the combo these keys complete, 0 = none
+    uint8_t extends; // top layers on which a larger combo contains these keys
+} combo_entry_t;
+
+static combo_entry_t combo_table[COMBO_TABLE_SIZE];
+static uint8_t combo_layers = 0; // top layers with any combo
+
+static keyrecord_t combo_held[COMBO_MAX_KEYS];
+static uint8_t combo_held_count = 0;
+static uint64_t combo_keys = 0;   // keys in the open window, held or passed on
+static uint64_t combo_passed = 0; // keys in the window already passed on
+static uint16_t combo_since;      // the window's first press
+static const combo_entry_t *combo_entry = NULL;
+static uint64_t combo_dropped = 0; // keys of fired combos whose release is dropped
+
+HOT_PATH uint16_t combo_hash(uint64_t keys) {
+    uint32_t folded = (uint32_t)keys ^ (uint32_t)(keys >> 32);
+    return (folded * 0x9E3779B1u) >> (32 - COMBO_TABLE_BITS);
+}
+
+// The slot holding keys, or the free slot where it belongs. The table is at
+// most half full, so a probe always ends.
+HOT_PATH combo_entry_t *combo_slot(uint64_t keys) {
+    PERF_BEGIN(PERF_TAG_COMBO);
+    uint16_t slot = combo_hash(keys);
+    while (combo_table[slot].keys && combo_table[slot].keys != keys) {
+        slot = (slot + 1) & (COMBO_TABLE_SIZE - 1);
+    }
+    PERF_END(PERF_HOOK_COMBO);
+    return &combo_table[slot];
+}
+
+HOT_PATH const combo_entry_t *combo_lookup(uint64_t keys) {
+    const combo_entry_t *entry = combo_slot(keys);
+    return entry->keys ? entry : NULL;
+}
+
+void combo_insert(uint64_t keys, uint64_t first, uint8_t combo, uint8_t active) {
+    for (uint64_t subset = keys; subset; subset = (subset - 1) & keys) {
+        if (!(subset & first)) continue;
+        combo_entry_t *entry = combo_slot(subset);
+        entry->keys = subset;
+        if (subset != keys) {
+            entry->extends |= active;
+        } else if (!entry->combo) {
+            entry->combo = combo;
+        }
+    }
+    combo_layers |= active;
+}
+
+// Combo keys are found by their keycode on _BASE, so the table follows the
+// keymap. Bench padding is pairs of positions on no layer: they fill the
+// table like real combos but never hold a key back.
+void combo_init(void) {
+    for (uint8_t i = 0; i < LAYER_COMBO_COUNT; i++) {
+        uint64_t keys = 0, first = 0;
+        uint8_t found = 0, wanted = 0;
+        for (uint8_t k = 0; k < COMBO_MAX_KEYS && layer_combos[i].keys[k] != KC_NO; k++) {
+            wanted++;
+            for (uint8_t pos = 0; pos < MATRIX_ROWS * MATRIX_COLS; pos++) {
+                if (keycode_at_keymap_location(_BASE, pos / MATRIX_COLS, pos % MATRIX_COLS) == layer_combos[i].keys[k]) {
+                    keys |= (uint64_t)1 << pos;
+                    first |= k == 0 ? (uint64_t)1 << pos : 0;
+                    found++;
+                    break;
+                }
+            }
+        }
+        if (found == wanted && found > 1) {
+            combo_insert(keys, first, i + 1, layer_combos[i].active);
+        }
+    }
+#if COMBO_BENCH_COUNT
+    for (uint16_t i = LAYER_COMBO_COUNT; i < COMBO_BENCH_COUNT; i++) {
+        uint8_t a = i % (MATRIX_ROWS * MATRIX_COLS);
+        uint8_t b = (a + 1 + i / (MATRIX_ROWS * MATRIX_COLS)) % (MATRIX_ROWS * MATRIX_COLS);
+        combo_insert(((uint64_t)1 << a) | ((uint64_t)1 << b), (uint64_t)1 << a, 0, 0);
+    }
+#endif
+}
+
+HOT_PATH bool combo_completes(const combo_entry_t *entry, uint8_t top) {
+    return entry && entry->combo && (layer_combos[entry->combo - 1].active & top);
+}
+
+HOT_PATH bool combo_usable(const combo_entry_t *entry, uint8_t top) {
+    return entry && ((entry->extends & top) || combo_completes(entry, top));
+}
+
+// A speculative digit: it was typed on its press and a backspace takes it back
+HOT_PATH bool combo_retractable(keypos_t key) {
+    uint16_t keycode = resolved_keycode(key);
+    return IS_QK_TAP_DANCE(keycode) && QK_TAP_DANCE_GET_INDEX(keycode) < TD_COUNT &&
+           (pgm_read_byte(&td_descriptors[QK_TAP_DANCE_GET_INDEX(keycode)].flags) & TD_SPECULATIVE);
+}
+
+// Fires the combo the window's keys complete, or replays the held ones and
+// closes the window; true if it fired. Keys passed on keep their release, so
+// their tap dances end normally.
+HOT_PATH bool combo_resolve(uint8_t top) {
+    const combo_entry_t *entry = combo_entry;
+    uint8_t count = combo_held_count;
+    uint64_t keys = combo_keys, passed = combo_passed;
+    combo_held_count = 0;
+    combo_entry = NULL;
+    combo_keys = combo_passed = 0;
+
+    if (combo_completes(entry, top)) {
+        combo_dropped |= keys & ~passed;
+        if (passed) {
+            td_retract(__builtin_popcountll(passed));
+        }
+        layer_move(layer_combos[entry->combo - 1].layer);
+        return true;
+    }
+    for (uint8_t i = 0; i < count; i++) {
+        tap_hold_dispatch(combo_held[i]);
+    }
+    return false;
+}
+
+HOT_PATH uint8_t combo_top_layer(void) {
+    return COMBO_ON(get_highest_layer(layer_state | default_layer_state));
+}
+
+HOT_PATH void combo_task(void) {
+    if (combo_keys && timer_elapsed(combo_since) >= COMBO_TERM) {
+        combo_resolve(combo_top_layer());
+    }
+}
+
+// Returns true if the event should go on to the tap-hold stage now
+HOT_PATH bool combo_process(keyrecord_t *record) {
+    keypos_t key = record->event.key;
+    if (key.row >= MATRIX_ROWS || key.col >= MATRIX_COLS) {
+        return true;
+    }
+    uint64_t bit = (uint64_t)1 << (key.row * MATRIX_COLS + key.col);
+    uint8_t top = combo_top_layer();
+
+    if (!record->event.pressed) {
+        if (combo_dropped & bit) {
+            combo_dropped &= ~bit;
+            return false;
+        }
+        // A key of the window let go: a complete combo still fires,
+        // otherwise the held presses go out ahead of this release
+        if ((combo_keys & bit) && combo_resolve(top) && (combo_dropped & bit)) {
+            combo_dropped &= ~bit;
+            return false;
+        }
+        return true;
+    }
+
+    // Played-back macros keep their recorded timing
+    if ((!combo_keys && !(combo_layers & top)) || macro_token != INVALID_DEFERRED_TOKEN) {
+        return true;
+    }
+    const combo_entry_t *entry = combo_lookup(combo_keys | bit);
+    if (!combo_usable(entry, top) && combo_keys) {
+        combo_resolve(top);
+        entry = combo_lookup(bit);
+    }
+    if (!combo_usable(entry, top)) {
+        return true;
+    }
 
-void do_jiggle(void) {
-    counter = counter + 1;
-    SEND_STRING(SS_DELAY(1));
-    c1 = counter % 13;
-    c2 = counter % 37;
-    if (c1 == 0) {
-        SEND_STRING(SS_DELAY(10000));
-        tap_code(MS_UP);
-        tap_code(MS_DOWN);
+    if (!combo_keys) {
+        combo_since = record->event.time;
     }
-    if (c2 == 0) {
-        SEND_STRING(SS_DELAY(30000));
-        tap_code(MS_LEFT);
-        tap_code(MS_RGHT);
+    combo_keys |= bit;
+    combo_entry = entry;
+    if (!(entry->extends & top)) {
+        combo_held[combo_held_count++] = *record;
+        combo_resolve(top);
+        return false;
     }
-    if (counter == 1000) {
-        counter = 0;
+    // Passed on, the key is sent at once; the backspace is only right if the
+    // digit really comes out now rather than after a buffered tap-hold press
+    if (combo_retractable(key) && tap_hold_idle()) {
+        combo_passed |= bit;
+        return true;
     }
+    combo_held[combo_held_count++] = *record;
+    return false;
+}
+
+// Key events pass combos, then tap-hold decisions, then the tapping layer and
+// tap dances; each stage may hold events back and replay them into the next
+HOT_PATH bool pre_process_record_user(uint16_t keycode, keyrecord_t *record) {
+    return combo_process(record) && tap_hold_process(record);
 }
 
 void matrix_init_user(void) {
 }
 
-void matrix_scan_user(void) {
-    if (jiggle_macro) {
-        do_jiggle();
+HOT_PATH void matrix_scan_user(void) {
+    PERF_BEGIN(PERF_TAG_SCAN);
+    release_queue_task();
+    combo_task();
+    tap_hold_task();
+    PERF_END(PERF_HOOK_SCAN);
+}
+
+void housekeeping_task_user(void) {
+    slave_layer_task();
+    lights_render_task();
+#ifdef SPLIT_LOCAL_LIGHTS
+    split_lights_task();
+#endif
+#ifdef TUNING_ENABLE
+    tuning_task();
+#endif
+#ifdef ADAPTIVE_TAPPING_TERM
+    adaptive_term_task();
+#endif
+#ifdef HEATMAP_ENABLE
+    heatmap_task();
+#endif
+#ifdef REVERIE_PERF_ENABLE
+    perf_loop_task();
+#endif
+}
+
+#ifdef REVERIE_PERF_ENABLE
+bool process_record_reverie(uint16_t keycode, keyrecord_t *record);
+
+HOT_PATH bool process_record_user(uint16_t keycode, keyrecord_t *record) {
+    PERF_BEGIN(keycode);
+    if (record->event.pressed && !IS_QK_TAP_DANCE(keycode)) {
+        perf_latency(TD_COUNT, timer_elapsed(record->event.time));
     }
+    bool result = process_record_reverie(keycode, record);
+    PERF_END(PERF_HOOK_RECORD);
+    return result;
 }
+#else
+#define process_record_reverie process_record_user
+#endif
+
+HOT_PATH bool process_record_reverie(uint16_t keycode, keyrecord_t *record) {
+    if (record->event.pressed) {
+        release_queue_flush();
+#ifdef HEATMAP_ENABLE
+        heatmap_press(resolved_layer(record->event.key), record->event.key);
+#endif
+    }
+#ifdef ADAPTIVE_TAPPING_TERM
+    // process_tap_dance() only sees the event after this: a press lands in a
+    // running dance, and a dance still unfinished on release was tapped. No
+    // state (all TAP_DANCE_MAX_SIMULTANEOUS slots in use) means no dance.
+    if (IS_QK_TAP_DANCE(keycode) && QK_TAP_DANCE_GET_INDEX(keycode) < TD_COUNT) {
+        tap_dance_state_t *state = tap_dance_get_state(QK_TAP_DANCE_GET_INDEX(keycode));
+        adaptive_term_record(keycode, record, state && !state->finished && (!record->event.pressed || state->count));
+    }
+#endif
+    if (!macro_process(keycode, record)) {
+        return false;
+    }
 
-bool process_record_user(uint16_t keycode, keyrecord_t *record) {
     switch (keycode) {
         case JIGGLER:
             if (record->event.pressed) {
                 jiggle_macro = !jiggle_macro;
                 if (jiggle_macro) {
-                    // Turn on a light or provide feedback
-                    rgblight_setrgb(0x00, 0xFF, 0x00); // Green
+                    jiggle_start();
                 } else {
-                    // Turn off the light or revert feedback
-                    rgblight_setrgb(0xFF, 0x00, 0x00); // Red
+                    jiggle_stop();
                 }
+                indicators_set(INDICATOR_JIGGLER, jiggle_macro);
             }
             return false;
         case TURBO:
             if (record->event.pressed) {
                 turbo_macro = !turbo_macro;
-                if (turbo_macro) {
-                    rgblight_setrgb(0x00, 0x00, 0xFF); // Blue
-                } else {
-                    rgblight_setrgb(0xFF, 0x00, 0x00); // Red
+                if (!turbo_macro) {
+                    turbo_stop();
                 }
+                indicators_set(INDICATOR_TURBO, turbo_macro);
             }
             return false;
+#ifdef KINETIC_MOUSE
+        case MS_UP:
+        case MS_DOWN:
+        case MS_LEFT:
+        case MS_RGHT:
+            kinetic_mouse_record(keycode, record);
+            return false;
+#endif
+    }
+
+    if (turbo_macro) {
+        turbo_track(keycode, record);
     }
     return true;
 }
+
+// ----------------------
+// Raw HID control channel
+// ----------------------
+
+// Requests and replies are RAW_EPSIZE bytes with the command in byte 0; the
+// reply echoes the command, or HID_CMD_UNKNOWN if it isn't supported by this
+// build. Block transfers carry a 16-bit offset in bytes 1-2, a byte count in
+// byte 3 and the data from byte 4 onwards; reads fill in the count and data.
+// tools/reverie-hid is the host side of this protocol.
+#ifdef RAW_ENABLE
+enum hid_commands {
+    HID_CMD_PERF_READ    = 0x01,
+    HID_CMD_PERF_RESET   = 0x02,
+    HID_CMD_TRACE_LOAD   = 0x03, // block write into the trace buffer
+    HID_CMD_TRACE_RUN    = 0x04, // byte 1: layer, bytes 2-3: event count; byte 4 is 1 if started,
+                                 // bytes 5-6: first event not on the layer (= count if none)
+    HID_CMD_TRACE_STATUS = 0x05, // bytes 1-2: events still to replay
+    HID_CMD_LATENCY_READ = 0x06,
+    HID_CMD_HEATMAP_READ  = 0x07,
+    HID_CMD_HEATMAP_RESET = 0x08,
+    HID_CMD_TUNING_READ   = 0x09,
+    HID_CMD_TUNING_WRITE  = 0x0A, // block write, applied to both halves at once
+    HID_CMD_TUNING_SAVE   = 0x0B,
+    HID_CMD_TUNING_RESET  = 0x0C, // back to the config.h values, not saved
+    HID_CMD_UNKNOWN      = 0xFF,
+};
+
+#define HID_BLOCK_HEADER 4
+
+void hid_read_block(uint8_t *data, uint8_t length, const void *block, uint16_t size);
+void hid_write_block(uint8_t *data, uint8_t length, void *block, uint16_t size);
+
+void hid_write_block(uint8_t *data, uint8_t length, void *block, uint16_t size) {
+    uint16_t offset = data[1] | (data[2] << 8);
+    uint8_t count = 0;
+    if (offset < size) {
+        count = MIN(data[3], length - HID_BLOCK_HEADER);
+        count = MIN(count, (uint16_t)(size - offset));
+        memcpy((uint8_t *)block + offset, &data[HID_BLOCK_HEADER], count);
+    }
+    data[3] = count;
+}
+
+void hid_read_block(uint8_t *data, uint8_t length, const void *block, uint16_t size) {
+    uint16_t offset = data[1] | (data[2] << 8);
+    uint8_t count = 0;
+    if (offset < size) {
+        count = MIN(size - offset, length - HID_BLOCK_HEADER);
+        memcpy(&data[HID_BLOCK_HEADER], (const uint8_t *)block + offset, count);
+    }
+    data[3] = count;
+}
+
+void raw_hid_receive(uint8_t *data, uint8_t length) {
+    switch (data[0]) {
+#ifdef REVERIE_PERF_ENABLE
+        case HID_CMD_PERF_READ:
+            hid_read_block(data, length, &perf, sizeof(perf));
+            break;
+        case HID_CMD_PERF_RESET:
+            perf_reset();
+            break;
+        case HID_CMD_TRACE_LOAD:
+            hid_write_block(data, length, trace, sizeof(trace));
+            break;
+        case HID_CMD_TRACE_RUN: {
+            uint16_t events = data[2] | (data[3] << 8);
+            uint16_t unresolved = events <= TRACE_MAX_EVENTS ? trace_unresolved(data[1], events) : events;
+            data[4] = trace_start(data[1], events);
+            data[5] = unresolved & 0xFF;
+            data[6] = unresolved >> 8;
+            break;
+        }
+        case HID_CMD_TRACE_STATUS: {
+            uint16_t remaining = trace_token == INVALID_DEFERRED_TOKEN ? 0 : trace_length - trace_position;
+            data[1] = remaining & 0xFF;
+            data[2] = remaining >> 8;
+            break;
+        }
+        case HID_CMD_LATENCY_READ:
+            hid_read_block(data, length, latency_histogram, sizeof(latency_histogram));
+            break;
+#endif
+#ifdef HEATMAP_ENABLE
+        case HID_CMD_HEATMAP_READ:
+            hid_read_block(data, length, &heatmap.counts, sizeof(heatmap.counts));
+            break;
+        case HID_CMD_HEATMAP_RESET:
+            heatmap_reset();
+            break;
+#endif
+#ifdef TUNING_ENABLE
+        case HID_CMD_TUNING_READ:
+            hid_read_block(data, length, &tuning, sizeof(tuning));
+            break;
+        case HID_CMD_TUNING_WRITE:
+            hid_write_block(data, length, &tuning, sizeof(tuning));
+            tuning_apply();
+            break;
+        case HID_CMD_TUNING_SAVE:
+            tuning_save();
+            break;
+        case HID_CMD_TUNING_RESET:
+            tuning_reset();
+            break;
+#endif
+        default:
+            data[0] = HID_CMD_UNKNOWN;
+            break;
+    }
+    raw_hid_send(data, length);
+}
+#endif
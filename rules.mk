@@ -2,6 +2,8 @@ RGBLIGHT_ENABLE = yes # by default this is no, but for the rgb light layers to w
 RGB_MATRIX_ENABLE = no # by default this is yes, but for the rgb light layers to work it needs to be `no`
 MOUSEKEY_ENABLE = yes
 TAP_DANCE_ENABLE = yes
+DEFERRED_EXEC_ENABLE = yes
+DEBOUNCE_TYPE = custom # layer-aware per-key debounce in keymap.c
 LTO_ENABLE = yes
 STENO_ENABLE = no
 BOOTMAGIC_ENABLE =no
@@ -13,3 +15,45 @@ KEY_LOCK_ENABLE = no
 AUDIO_ENABLE = no
 CONSOLE_ENABLE = no
 VELOCIKEY_ENABLE = no
+
+# Scan-loop performance counters, read over raw HID with tools/reverie-hid
+REVERIE_PERF_ENABLE = no
+
+ifeq ($(strip $(REVERIE_PERF_ENABLE)), yes)
+    OPT_DEFS += -DREVERIE_PERF_ENABLE
+    RAW_ENABLE = yes
+endif
+
+# Render RGB layers locally on each half from the synced layer state instead of
+# mirroring the whole rgblight state over the TRRS link
+SPLIT_LOCAL_LIGHTS = no
+
+ifeq ($(strip $(SPLIT_LOCAL_LIGHTS)), yes)
+    OPT_DEFS += -DSPLIT_LOCAL_LIGHTS
+endif
+
+# Run the keymap's key-event code (process_record_user, tap dances, debounce,
+# keymap lookups) from SRAM instead of flash; the QMK core and libgcc functions
+# it calls stay in flash
+HOT_PATH_IN_RAM = yes
+
+ifeq ($(strip $(HOT_PATH_IN_RAM)), yes)
+    OPT_DEFS += -DHOT_PATH_IN_RAM
+endif
+
+# Per-key usage heatmap, exported over raw HID with tools/reverie-hid heatmap
+HEATMAP_ENABLE = no
+
+ifeq ($(strip $(HEATMAP_ENABLE)), yes)
+    OPT_DEFS += -DHEATMAP_ENABLE
+    RAW_ENABLE = yes
+endif
+
+# Live timing parameters (tapping term, debounce, mouse, jiggler, turbo), read,
+# set and saved over raw HID with tools/reverie-hid tune
+TUNING_ENABLE = yes
+
+ifeq ($(strip $(TUNING_ENABLE)), yes)
+    OPT_DEFS += -DTUNING_ENABLE
+    RAW_ENABLE = yes
+endif
@@ -0,0 +1,206 @@
+#!/usr/bin/env python3
+# Tests for the pure-Python parts of tools/reverie-hid
+# SPDX-License-Identifier: GPL-2.0-or-later
+#
+# Run with: python3 -m unittest discover tools
+
+import contextlib
+import importlib.machinery
+import importlib.util
+import io
+import json
+import os
+import struct
+import sys
+import tempfile
+import unittest
+
+sys.dont_write_bytecode = True
+_path = os.path.join(os.path.dirname(os.path.abspath(__file__)), "reverie-hid")
+_loader = importlib.machinery.SourceFileLoader("reverie_hid", _path)
+_spec = importlib.util.spec_from_loader("reverie_hid", _loader)
+hid = importlib.util.module_from_spec(_spec)
+_loader.exec_module(hid)
+
+CHUNK = hid.RAW_EPSIZE - hid.HID_BLOCK_HEADER
+
+
+class BlockDevice(hid.Device):
+    """Answers block reads and writes like hid_read_block() and
+    hid_write_block() in keymap.c, over a block of a fixed size."""
+
+    def __init__(self, size, accept=None):
+        self.block = bytearray(size)
+        self.accept = accept  # bytes a write takes at most, as a short device
+        self.reports = []
+
+    def transfer(self, report):
+        self.assert_report(report)
+        self.reports.append(report)
+        reply = bytearray(report)
+        offset, count = struct.unpack_from("<HB", report, 1)
+        if report[0] == hid.HID_CMD_TRACE_LOAD:
+            count = min(count, CHUNK, len(self.block) - offset) if offset < len(self.block) else 0
+            if self.accept is not None:
+                count = min(count, self.accept)
+            self.block[offset:offset + count] = report[hid.HID_BLOCK_HEADER:hid.HID_BLOCK_HEADER + count]
+        else:
+            data = self.block[offset:offset + CHUNK]
+            count = len(data)
+            reply[hid.HID_BLOCK_HEADER:hid.HID_BLOCK_HEADER + count] = data
+        reply[3] = count
+        return bytes(reply)
+
+    @staticmethod
+    def assert_report(report):
+        if len(report) != hid.RAW_EPSIZE:
+            raise AssertionError("report of %d bytes" % len(report))
+
+
+def quietly(function, *args):
+    with contextlib.redirect_stderr(io.StringIO()):
+        return function(*args)
+
+
+class HeatmapRowsTest(unittest.TestCase):
+    def counts(self):
+        # Every count is its own index in the block, so a row names its source
+        total = hid.HEATMAP_PRESSES + len(hid.TAP_DANCES) * len(hid.TD_STEPS)
+        return list(range(total)), struct.pack(hid.HEATMAP_FORMAT, *range(total))
+
+    def test_presses_in_layer_row_col_order(self):
+        _, data = self.counts()
+        rows = hid.heatmap_rows(data)
+        self.assertEqual(rows[0], ["layer", "row", "col", "presses"])
+        self.assertEqual(len(rows), 1 + hid.HEATMAP_PRESSES)
+
+        layers = sorted(hid.LAYERS, key=hid.LAYERS.get)
+        expected = [[layer, row, col] for layer in layers for row in range(hid.MATRIX_ROWS) for col in range(hid.MATRIX_COLS)]
+        self.assertEqual([row[:3] for row in rows[1:]], expected)
+        self.assertEqual([row[3] for row in rows[1:]], list(range(hid.HEATMAP_PRESSES)))
+
+    def test_tap_dances_skip_none_and_reserved(self):
+        counts, data = self.counts()
+        rows = hid.heatmap_rows(data, tap_dances=True)
+        self.assertEqual(rows[0], ["tap_dance", "outcome", "count"])
+        self.assertEqual(len(rows), 1 + len(hid.TAP_DANCES) * (len(hid.TD_STEPS) - 2))
+
+        outcomes = hid.TD_STEPS[1:-1]
+        for index, name in enumerate(hid.TAP_DANCES):
+            block = rows[1 + index * len(outcomes):1 + (index + 1) * len(outcomes)]
+            self.assertEqual([row[:2] for row in block], [[name, outcome] for outcome in outcomes])
+            base = hid.HEATMAP_PRESSES + index * len(hid.TD_STEPS)
+            self.assertEqual([row[2] for row in block], counts[base + 1:base + len(hid.TD_STEPS) - 1])
+
+    def test_short_block_is_refused(self):
+        _, data = self.counts()
+        with self.assertRaises(struct.error):
+            hid.heatmap_rows(data[:-2])
+
+
+class BlockFramingTest(unittest.TestCase):
+    def test_write_splits_into_chunks(self):
+        device = BlockDevice(2 * CHUNK + 4)
+        data = bytes(range(len(device.block)))
+        device.write_block(hid.HID_CMD_TRACE_LOAD, data)
+
+        framing = [struct.unpack_from("<BHB", report) for report in device.reports]
+        self.assertEqual(framing, [
+            (hid.HID_CMD_TRACE_LOAD, 0, CHUNK),
+            (hid.HID_CMD_TRACE_LOAD, CHUNK, CHUNK),
+            (hid.HID_CMD_TRACE_LOAD, 2 * CHUNK, 4),
+        ])
+        self.assertEqual(bytes(device.block), data)
+
+    def test_read_round_trip(self):
+        device = BlockDevice(3 * CHUNK)
+        data = bytes((i * 7) & 0xFF for i in range(len(device.block)))
+        device.block[:] = data
+        self.assertEqual(device.read_block(hid.HID_CMD_LATENCY_READ, len(data)), data)
+        offsets = [struct.unpack_from("<H", report, 1)[0] for report in device.reports]
+        self.assertEqual(offsets, [0, CHUNK, 2 * CHUNK])
+
+    def test_read_without_size_stops_at_the_end(self):
+        device = BlockDevice(CHUNK + 1)
+        device.block[:] = b"\x5a" * len(device.block)
+        self.assertEqual(device.read_block(hid.HID_CMD_LATENCY_READ), b"\x5a" * (CHUNK + 1))
+        # The last request starts at the end of the block and gets nothing
+        self.assertEqual(struct.unpack_from("<HB", device.reports[-1], 1)[0], CHUNK + 1)
+
+    def test_short_read_dies(self):
+        device = BlockDevice(10)
+        with self.assertRaises(SystemExit):
+            quietly(device.read_block, hid.HID_CMD_LATENCY_READ, 12)
+
+    def test_partly_accepted_write_dies(self):
+        device = BlockDevice(CHUNK, accept=CHUNK - 1)
+        with self.assertRaises(SystemExit):
+            quietly(device.write_block, hid.HID_CMD_TRACE_LOAD, bytes(CHUNK))
+
+    def test_write_past_the_end_dies(self):
+        device = BlockDevice(CHUNK)
+        with self.assertRaises(SystemExit):
+            quietly(device.write_block, hid.HID_CMD_TRACE_LOAD, bytes(CHUNK + 1))
+        self.assertEqual(device.reports[-1][3], 1)
+
+
+class StandInTest(unittest.TestCase):
+    def setUp(self):
+        handle, self.path = tempfile.mkstemp(suffix=".json")
+        os.close(handle)
+        os.unlink(self.path)
+        self.device = hid.StandIn(self.path)
+        self.size = struct.calcsize(hid.TUNING_FORMAT)
+        self.defaults = [default for _, default, _, _ in hid.TUNING_PARAMS]
+
+    def tearDown(self):
+        if os.path.exists(self.path):
+            os.unlink(self.path)
+
+    def write(self, offset, data, count=None):
+        count = len(data) if count is None else count
+        return self.device.request(hid.HID_CMD_TUNING_WRITE, struct.pack("<HB", offset, count) + data)
+
+    def live(self):
+        return struct.unpack(hid.TUNING_FORMAT, self.device.read_block(hid.HID_CMD_TUNING_READ, self.size))
+
+    def test_read_is_the_defaults(self):
+        self.assertEqual(list(self.live()), self.defaults)
+
+    def test_read_at_or_past_the_end_is_empty(self):
+        for offset in (self.size, self.size + 1, 0xFFFF):
+            self.assertEqual(self.device.request(hid.HID_CMD_TUNING_READ, struct.pack("<H", offset))[3], 0)
+
+    def test_read_near_the_end_returns_the_rest(self):
+        self.assertEqual(self.device.request(hid.HID_CMD_TUNING_READ, struct.pack("<H", self.size - 2))[3], 2)
+
+    def test_write_at_or_past_the_end_writes_nothing(self):
+        for offset in (self.size, self.size + 1, 0xFFFF):
+            reply = self.write(offset, b"\xff" * CHUNK)
+            self.assertEqual(reply[3], 0)
+            self.assertEqual(list(self.live()), self.defaults)
+
+    def test_write_across_the_end_is_clamped(self):
+        reply = self.write(self.size - 2, b"\x00" * CHUNK)
+        self.assertEqual(reply[3], 2)
+        with open(self.path) as f:
+            self.assertEqual(len(json.load(f)["live"]), len(hid.TUNING_PARAMS))
+
+    def test_write_count_is_clamped_to_the_packet(self):
+        reply = self.write(0, b"", count=0xFF)
+        self.assertEqual(reply[3], CHUNK if self.size > CHUNK else self.size)
+
+    def test_round_trip_clamps_and_persists(self):
+        values = [high for _, _, _, high in hid.TUNING_PARAMS]
+        values[0] = 0xFFFF
+        self.device.write_block(hid.HID_CMD_TUNING_WRITE, struct.pack(hid.TUNING_FORMAT, *values))
+        expected = hid.tuning_clamp(values)
+        self.assertEqual(list(self.live()), expected)
+        self.assertEqual(list(struct.unpack(hid.TUNING_FORMAT, hid.StandIn(self.path).read_block(hid.HID_CMD_TUNING_READ, self.size))), expected)
+
+    def test_unknown_command(self):
+        self.assertIsNone(self.device.request(hid.HID_CMD_PERF_READ, optional=True))
+
+
+if __name__ == "__main__":
+    unittest.main()